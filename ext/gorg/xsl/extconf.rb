@@ -15,6 +15,11 @@ unless have_library('exslt','exsltRegisterAll')
  exit(1)
 end
 
+# To count the bytes that libxml2 holds, see xmem.c
+have_header("malloc.h")
+have_func("malloc_usable_size", "malloc.h")
+have_func("rb_gc_adjust_memory_usage")
+
 $LDFLAGS << ' ' << `xslt-config --libs`.chomp
 
 $CFLAGS << ' ' << `xslt-config --cflags`.chomp
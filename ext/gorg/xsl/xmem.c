@@ -0,0 +1,394 @@
+/*
+    Copyright 2004,   Xavier Neys   (neysx@gentoo.org)
+
+    This file is part of gorg.
+
+    gorg is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    gorg is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gorg; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ *  Memory functions handed over to libxml2 with xmlMemSetup()
+ *
+ *  By default, they simply call malloc & co.
+ *
+ *  When the arena is switched on (see xmem_arena_begin), every block that libxml2
+ *  or libxslt allocate is carved out of a few large chunks. Freed blocks are kept
+ *  on a free list per size class and handed out again, the chunks are unmapped
+ *  in one go when the transform is over (xmem_arena_end).
+ *  Chunks never add up to more than the arena's ceiling, blocks are taken from
+ *  the heap once it has been reached.
+ *  Blocks that were allocated on the heap before the arena was switched on
+ *  are still freed & realloc'ed on the heap.
+ *
+ *  Either way, they keep count of the bytes libxml2 & libxslt hold (heap blocks
+ *  and arena chunks) and of the peak, see xmem_usage. Ruby's GC cannot see that memory,
+ *  xsl.c tells it how much there is after each transform.
+ */
+
+#include "xsl.h"
+#include <sys/mman.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+// Actual size of a heap block, without it we can only count blocks, not bytes
+#if defined(HAVE_MALLOC_USABLE_SIZE)
+#define HEAP_SIZE(p)      malloc_usable_size(p)
+#else
+#define HEAP_SIZE(p)      ((size_t)0)
+#endif
+
+// Every block starts with its size so that realloc knows how much to copy
+#define ARENA_ALIGN       16
+#define ARENA_HDR         ARENA_ALIGN
+#define ARENA_ROUND(n)    (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+// Chunks grow from 256KB up to 16MB so that a big handbook only needs a handful of them
+#define ARENA_FIRST_CHUNK (256*1024)
+#define ARENA_MAX_CHUNK   (16*1024*1024)
+// Size classes: multiples of 16 bytes up to 1KB, then powers of 2 up to 16MB
+// Bigger blocks are not recycled
+#define ARENA_SMALL       1024
+#define ARENA_CLASSES     (ARENA_SMALL/ARENA_ALIGN + 15)
+
+typedef struct S_chunk
+{
+  struct S_chunk *next;
+  char *data, *cur, *end;
+  size_t size;
+}
+s_chunk;
+
+static s_chunk *arena = NULL;      // List of chunks, newest first
+static char    *arenaLast = NULL;  // Last block handed out, can be grown or given back in place
+static size_t   arenaNext = ARENA_FIRST_CHUNK;
+static size_t   arenaMax = 0;      // Most bytes of chunks per transform, 0 means no limit
+static int      arenaOn = 0;
+static void    *arenaFree[ARENA_CLASSES]; // Freed blocks per size class, linked through their first bytes
+static s_xmemstats arenaStats;
+static s_xmemusage usage;
+
+
+static void usageAdd(size_t bytes)
+{
+  usage.live += bytes;
+  if (usage.live > usage.peak)
+    usage.peak = usage.live;
+  if (usage.live > usage.markPeak)
+    usage.markPeak = usage.live;
+}
+
+static void usageSub(size_t bytes)
+{
+  // Blocks that libxml2 allocated before xmem_init would take us below 0
+  usage.live = bytes < usage.live ? usage.live - bytes : 0;
+}
+
+
+/*
+ *  Is ptr a block of the arena?
+ *  Chunks grow geometrically, we never have more than a few dozens of them.
+ */
+static int arenaOwns(void *ptr)
+{
+  s_chunk *c;
+
+  for (c = arena; c; c = c->next)
+    if ((char *)ptr >= c->data && (char *)ptr < c->end)
+      return 1;
+  return 0;
+}
+
+/*
+ *  Room actually reserved for a block of size bytes, and its size class (-1 if it has none)
+ */
+static size_t arenaRoom(size_t size)
+{
+  size_t room;
+
+  if (size <= ARENA_SMALL)
+    return size < ARENA_ALIGN ? ARENA_ALIGN : ARENA_ROUND(size);
+  for (room = 2*ARENA_SMALL; room < size && room < ARENA_MAX_CHUNK; room *= 2)
+    ;
+  return room < size ? ARENA_ROUND(size) : room;
+}
+
+static int arenaClass(size_t room)
+{
+  int k = ARENA_SMALL/ARENA_ALIGN;
+
+  if (room <= ARENA_SMALL)
+    return (int) (room/ARENA_ALIGN) - 1;
+  if (room > ARENA_MAX_CHUNK)
+    return -1;
+  for (room /= 2*ARENA_SMALL; room > 1; room /= 2)
+    k++;
+  return k < ARENA_CLASSES ? k : -1;
+}
+
+/*
+ *  Return a block of the arena or NULL if there is no room left for it,
+ *  caller is expected to fall back on the heap
+ */
+static void *arenaAlloc(size_t size)
+{
+  size_t room = arenaRoom(size);
+  size_t need = ARENA_HDR + room;
+  size_t csize;
+  int k = arenaClass(room);
+  s_chunk *c;
+  char *p;
+
+  if (k >= 0 && arenaFree[k] != NULL)
+  {
+    // Recycle a freed block of the same class
+    p = arenaFree[k];
+    arenaFree[k] = *(void **)p;
+    *(size_t *)(p - ARENA_HDR) = size;
+    arenaStats.allocs++;
+    arenaStats.reuses++;
+    arenaStats.bytes += size;
+    return p;
+  }
+  if (arena == NULL || arena->cur + need > arena->end)
+  {
+    csize = arenaNext;
+    if (csize < need + ARENA_ROUND(sizeof(s_chunk)))
+      csize = need + ARENA_ROUND(sizeof(s_chunk));
+    if (arenaMax && arenaStats.chunkBytes + csize > arenaMax)
+    {
+      // Make do with what is left under the ceiling, if anything
+      if (arenaStats.chunkBytes + need + ARENA_ROUND(sizeof(s_chunk)) > arenaMax)
+        return NULL;
+      csize = arenaMax - arenaStats.chunkBytes;
+    }
+    // Chunks are mapped, not malloc'ed, so that they really go back to the system when released
+    c = (s_chunk *) mmap(NULL, csize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+      return NULL;
+    c->data = c->cur = (char *)c + ARENA_ROUND(sizeof(s_chunk));
+    c->end = (char *)c + csize;
+    c->size = csize;
+    c->next = arena;
+    arena = c;
+    if (arenaNext < ARENA_MAX_CHUNK)
+      arenaNext *= 2;
+    arenaStats.chunks++;
+    arenaStats.chunkBytes += csize;
+    usageAdd(csize);
+  }
+  p = arena->cur;
+  *(size_t *)p = size;
+  arena->cur += need;
+  arenaLast = p + ARENA_HDR;
+  arenaStats.allocs++;
+  arenaStats.bytes += size;
+  return arenaLast;
+}
+
+/*
+ *  Put a block of the arena on the free list of its class, or give it back if it's the last one
+ */
+static void arenaRelease(char *ptr)
+{
+  size_t room = arenaRoom(*(size_t *)(ptr - ARENA_HDR));
+  int k = arenaClass(room);
+
+  arenaStats.frees++;
+  if (ptr == arenaLast)
+  {
+    arena->cur = ptr - ARENA_HDR;
+    arenaLast = NULL;
+  }
+  else if (k >= 0)
+  {
+    *(void **)ptr = arenaFree[k];
+    arenaFree[k] = ptr;
+  }
+}
+
+
+static void *heapAlloc(size_t size)
+{
+  void *p;
+
+  if ((p = malloc(size)) != NULL)
+  {
+    usage.allocs++;
+    usageAdd(HEAP_SIZE(p));
+  }
+  return p;
+}
+
+void *xmem_malloc(size_t size)
+{
+  void *p;
+
+  if (arenaOn)
+  {
+    if ((p = arenaAlloc(size)) != NULL)
+      return p;
+    // Over the ceiling, the heap will do
+    arenaStats.overflows++;
+  }
+  return heapAlloc(size);
+}
+
+void xmem_free(void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  if (arena && arenaOwns(ptr))
+  {
+    arenaRelease((char *)ptr);
+    return;
+  }
+  usage.frees++;
+  usageSub(HEAP_SIZE(ptr));
+  free(ptr);
+}
+
+void *xmem_realloc(void *ptr, size_t size)
+{
+  size_t old;
+  void *p;
+
+  if (ptr == NULL)
+    return xmem_malloc(size);
+  if (!(arena && arenaOwns(ptr)))
+  {
+    // Heap block, leave it on the heap
+    old = HEAP_SIZE(ptr);
+    if ((p = realloc(ptr, size)) != NULL)
+    {
+      usageSub(old);
+      usageAdd(HEAP_SIZE(p));
+    }
+    return p;
+  }
+
+  arenaStats.reallocs++;
+  old = *(size_t *)((char *)ptr - ARENA_HDR);
+  if (arenaRoom(size) == arenaRoom(old))
+  {
+    // Same class, the block has room for it
+    *(size_t *)((char *)ptr - ARENA_HDR) = size;
+    return ptr;
+  }
+  if (ptr == arenaLast && size > old && (char *)ptr + arenaRoom(size) <= arena->end)
+  {
+    // Grow the last block in place, buffers that keep growing end up here
+    arena->cur = (char *)ptr + arenaRoom(size);
+    *(size_t *)((char *)ptr - ARENA_HDR) = size;
+    arenaStats.bytes += size - old;
+    return ptr;
+  }
+  if ((p = xmem_malloc(size)) == NULL)
+    return NULL;
+  memcpy(p, ptr, old < size ? old : size);
+  arenaRelease((char *)ptr);
+  return p;
+}
+
+char *xmem_strdup(const char *str)
+{
+  size_t len;
+  char *p;
+
+  if (str == NULL)
+    return NULL;
+  len = strlen(str) + 1;
+  if ((p = (char *) xmem_malloc(len)) != NULL)
+    memcpy(p, str, len);
+  return p;
+}
+
+
+/*
+ *  Resident set size in KB, 0 if unknown
+ */
+long xmem_rss(void)
+{
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL)
+    return 0;
+  if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+    rss = 0;
+  fclose(f);
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/*
+ *  Hand our functions over to libxml2, it must happen before libxml2 allocates anything
+ */
+void xmem_init(void)
+{
+  xmlMemSetup(xmem_free, xmem_malloc, xmem_realloc, xmem_strdup);
+}
+
+/*
+ *  Switch the arena on, every libxml2 allocation goes into it from now on
+ *  until its chunks add up to max bytes (0 means no limit)
+ */
+void xmem_arena_begin(size_t max)
+{
+  memset(&arenaStats, '\0', sizeof(arenaStats));
+  memset(arenaFree, '\0', sizeof(arenaFree));
+  arenaNext = ARENA_FIRST_CHUNK;
+  arenaMax = max;
+  arenaOn = 1;
+}
+
+/*
+ *  Switch the arena off and release all its chunks
+ *  Caller must make sure no pointer into the arena is used after that
+ */
+void xmem_arena_end(s_xmemstats *stats)
+{
+  s_chunk *c;
+
+  arenaOn = 0;
+  while ((c = arena))
+  {
+    arena = c->next;
+    usageSub(c->size);
+    munmap(c, c->size);
+  }
+  arenaLast = NULL;
+  memset(arenaFree, '\0', sizeof(arenaFree));
+  if (stats)
+    *stats = arenaStats;
+}
+
+int xmem_arena_active(void)
+{
+  return arenaOn;
+}
+
+
+/*
+ *  Start measuring a transform, markLive & markPeak are what it started from
+ */
+void xmem_mark(void)
+{
+  usage.markLive = usage.markPeak = usage.live;
+}
+
+void xmem_usage(s_xmemusage *u)
+{
+  *u = usage;
+}
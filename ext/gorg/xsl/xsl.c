@@ -76,6 +76,26 @@ VALUE g_xfiles=Qnil;
 VALUE g_xmsg=Qnil;
 VALUE g_mutex=Qnil;
 VALUE g_xtrack=Qnil; // true/false, no need to register this one
+VALUE g_xtrace=Qfalse; // true/false, no need to register this one either
+s_trace *g_trace=NULL; // I/O trace of the transform in progress, malloc'ed, never from the arena
+int   g_traceNr=0, g_traceMax=0;
+VALUE g_xarena=Qfalse; // Class-wide switch, true/false, no need to register this one either
+size_t g_xarenaMax=XMEM_ARENA_MAX; // Most bytes the arena may map per transform, the heap takes over beyond
+long  g_rssBefore=0;   // RSS when the arena was switched on
+long  g_lastDelta=0;   // Bytes libxml2 held after the last transform minus bytes it held before
+long  g_lastPeak=0;    // Most bytes libxml2 held during the last transform, over what it held before
+size_t g_gcReported=0; // Bytes held by libxml2 that ruby's GC has been told about
+
+/*
+ *   Limits of the transform in progress, see xsl_process_real
+ */
+xsltTransformContextPtr g_ctxt=NULL; // Set while the stylesheet is being applied
+struct timespec g_deadline;          // CLOCK_MONOTONIC, tv_sec==0 means no deadline
+int   g_maxDepth=0;                  // Max number of nested templates, 0 means no limit
+int   g_maxDocs=0;                   // Max number of files opened with document(), 0 means no limit
+int   g_docs=0;                      // Documents loaded by document() so far
+int   g_stopped=0;                   // XSL_ERR_xxx code of the limit that stopped the transform
+unsigned int g_ticks=0;              // Instructions executed, we only look at the clock now and then
 
 /*
  * Store ID's of ruby methodes to speed up calls to rb_funcall*
@@ -85,11 +105,89 @@ struct {
   int include;
   int to_a;
   int to_s;
+  int to_f;
   int length;
   int synchronize;
 } id;
 
 
+/*
+ *  Has the deadline of the transform in progress passed?
+ */
+int deadlinePassed(void)
+{
+  struct timespec now;
+
+  if (g_deadline.tv_sec == 0)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return    (now.tv_sec > g_deadline.tv_sec)
+         || (now.tv_sec == g_deadline.tv_sec && now.tv_nsec >= g_deadline.tv_nsec);
+}
+
+/*
+ *  Stop the transform in progress, libxslt unwinds as soon as it sees the state
+ *  Remember which limit was hit first
+ */
+void stopTransform(int why)
+{
+  if (!g_stopped)
+    g_stopped = why;
+  if (g_ctxt)
+    g_ctxt->state = XSLT_STATE_STOPPED;
+}
+
+/*
+ *  libxslt debugger hook, called before each instruction when the debugger status is on
+ *  Nothing to debug, we only use it to enforce the deadline and the template depth
+ */
+void xslLimitsHandler(xmlNodePtr cur ATTRIBUTE_UNUSED, xmlNodePtr node ATTRIBUTE_UNUSED,
+                      xsltTemplatePtr templ ATTRIBUTE_UNUSED, xsltTransformContextPtr ctxt)
+{
+  if (g_maxDepth && ctxt->templNr > g_maxDepth)
+    stopTransform(XSL_ERR_MAXDEPTH);
+  else if ((++g_ticks & 0xff) == 0 && deadlinePassed())
+    stopTransform(XSL_ERR_DEADLINE);
+}
+
+/*
+ *  libxslt document loader, the default one is called to do the job
+ *  Count the documents loaded by document() while the stylesheet is applied,
+ *  the DTD's and catalogs libxml2 reads on the way are not loaded by us and do not count
+ *  Documents loaded earlier in the same transform are reused by libxslt without calling us
+ */
+xsltDocLoaderFunc g_docLoader=NULL;
+
+xmlDocPtr xslDocLoader(const xmlChar *URI, xmlDictPtr dict, int options, void *ctxt, xsltLoadType type)
+{
+  if (g_ctxt != NULL && type == XSLT_LOAD_DOCUMENT && g_maxDocs && ++g_docs > g_maxDocs)
+    stopTransform(XSL_ERR_MAXDOCS);
+  // Once stopped, XRootOpen hands libxml2 an empty document instead of the file
+  return g_docLoader(URI, dict, options, ctxt, type);
+}
+
+/*
+ *  Input handed to libxml2 instead of a file once the transform has been stopped
+ *  NULL would make libxml2 try its default callbacks, i.e. open the file anyway
+ */
+void *stoppedInput(void)
+{
+  static const char stopped[] = "<?xml version='1.0'?><stopped/>";
+  int pip[2];
+
+  if (pipe(pip))
+    return NULL;
+  if (write(pip[1], stopped, sizeof(stopped)-1) < 0)
+  {
+    close(pip[0]);
+    close(pip[1]);
+    return NULL;
+  }
+  close(pip[1]);
+  return (void *) fdopen(pip[0], "r");
+}
+
+
 /*
  *  Add file to list of requested files, if not already in our array
  */
@@ -123,6 +221,129 @@ void addTrackedFile(char *f, const char *rw)
   }
 }
 
+/*
+ *  Seconds elapsed since t0
+ */
+static double elapsed(struct timespec *t0)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ *  Input context of a file opened while tracing, fd is returned as is when not tracing
+ *  Time spent opening it since t0 is charged to path
+ */
+static void *traceOpen(FILE *fd, const char *path, int missing, struct timespec *t0)
+{
+  s_traced *tr;
+  s_trace *t;
+  int i;
+
+  if (fd == NULL || Qtrue != g_xtrace)
+    return (void *) fd;
+  for (i = 0; i < g_traceNr; i++)
+    if (!strcmp(g_trace[i].path, path))
+      break;
+  if (i == g_traceNr)
+  {
+    if (g_traceNr == g_traceMax)
+    {
+      t = (s_trace *) realloc(g_trace, (g_traceMax + 32) * sizeof(s_trace));
+      if (t == NULL)
+      {
+        // Our read & close callbacks expect an s_traced context, a bare fd would not do
+        fclose(fd);
+        return NULL;
+      }
+      g_trace = t;
+      g_traceMax += 32;
+    }
+    if ((g_trace[i].path = strdup(path)) == NULL)
+    {
+      fclose(fd);
+      return NULL;
+    }
+    g_trace[i].opens = g_trace[i].bytes = 0;
+    g_trace[i].time = 0;
+    g_trace[i].missing = 0;
+    g_traceNr++;
+  }
+  if ((tr = (s_traced *) malloc(sizeof(s_traced))) == NULL)
+  {
+    // Cannot trace it, do not lose it
+    fclose(fd);
+    return NULL;
+  }
+  tr->fd = fd;
+  tr->entry = i;
+  g_trace[i].opens++;
+  g_trace[i].missing |= missing;
+  g_trace[i].time += elapsed(t0);
+  return (void *) tr;
+}
+
+/*
+ *  Read & close callbacks registered instead of xmlFileRead & XRootClose while tracing
+ */
+int XTraceRead(void *context, char *buffer, int len)
+{
+  s_traced *tr = (s_traced *) context;
+  struct timespec t0;
+  int n;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  n = xmlFileRead(tr->fd, buffer, len);
+  if (n > 0)
+    g_trace[tr->entry].bytes += n;
+  g_trace[tr->entry].time += elapsed(&t0);
+  return n;
+}
+
+int XTraceClose(void *context)
+{
+  s_traced *tr = (s_traced *) context;
+  struct timespec t0;
+  int r;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  r = xmlFileClose(tr->fd);
+  g_trace[tr->entry].time += elapsed(&t0);
+  free(tr);
+  return r;
+}
+
+/*
+ *  Hand the trace over to ruby as an array of hashes and forget it
+ */
+static void traceEnd(VALUE obj)
+{
+  VALUE rbTrace, h;
+  int i;
+
+  rbTrace = (NIL_P(obj) || Qtrue != g_xtrace) ? Qnil : rb_ary_new();
+  for (i = 0; i < g_traceNr; i++)
+  {
+    if (!NIL_P(rbTrace))
+    {
+      h = rb_hash_new();
+      rb_hash_aset(h, rb_str_new2("path"),    rb_str_new2(g_trace[i].path));
+      rb_hash_aset(h, rb_str_new2("opens"),   LONG2NUM(g_trace[i].opens));
+      rb_hash_aset(h, rb_str_new2("bytes"),   LONG2NUM(g_trace[i].bytes));
+      rb_hash_aset(h, rb_str_new2("time"),    rb_float_new(g_trace[i].time));
+      rb_hash_aset(h, rb_str_new2("missing"), g_trace[i].missing ? Qtrue : Qfalse);
+      rb_ary_push(rbTrace, h);
+    }
+    free(g_trace[i].path);
+  }
+  g_traceNr = 0;
+  if (!NIL_P(obj))
+    rb_iv_set(obj, "@xio", rbTrace);
+}
+
+
 /*
  *  libxml2 File I/O Match Callback :
  *    return 1 if we must handle the file ourselves
@@ -149,19 +370,34 @@ void *XRootOpen (const char *filename, const char* rw) {
   char *path = NULL;
   char *fakexml = NULL;
   FILE *fd;
+  void *ctx;
+  int  missing = 0;
   char *rbxrootPtr="";
   int  rbxrootLen=0;
   char empty[] = "<?xml version='1.0'?><missing file='%s'/>";
   int  pip[2];
   ssize_t result = 0;
   struct stat notused;
+  struct timespec t0;
 
 //printf("NSX-RootOpen: %s\n", filename);
 
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
   if (filename == NULL || (*filename != '/' && strncmp(filename, "file:///", 8))){
 	  return NULL; // I told you before, I can't help you with that file ;-)
   }
   
+  // Enforce the deadline on files opened while the stylesheet is applied (documents are counted by xslDocLoader)
+  // and stop opening anything once the transform has been stopped
+  if (g_ctxt != NULL && *rw == 'r')
+  {
+    if (deadlinePassed())
+      stopTransform(XSL_ERR_DEADLINE);
+    if (g_stopped)
+      return traceOpen((FILE *) stoppedInput(), filename, 0, &t0);
+  }
+
   if (g_xroot != Qnil)
   {
     rbxrootPtr = RSTRING_PTR(g_xroot);
@@ -207,14 +443,14 @@ void *XRootOpen (const char *filename, const char* rw) {
   addTrackedFile(path, rw);
   
   fd = fopen(path, rw);
-  free(path);
 
   if (*rw == 'r' && fd == NULL && strncmp(filename, "file:///", 8) && strlen(filename)>4 && strncmp((strlen(filename)-4)+filename, ".dtd", 4) && strncmp((strlen(filename)-4)+filename, ".xsl", 4))
+  {
     // Return fake xml
     // We don't know for sure that libxml2 wants an xml file from a document(),
     // but what the heck, let's just pretend
     if (pipe(pip))
-      return (void *) NULL;
+      fd = NULL;
     else
     {
       fakexml = (char *) malloc((strlen(filename) + sizeof(empty)) * sizeof(char));
@@ -225,10 +461,17 @@ void *XRootOpen (const char *filename, const char* rw) {
       assert(result = strlen(fakexml));
       close(pip[1]);
       free(fakexml);
-      return (void *) fdopen(pip[0], "r");
+      fd = fdopen(pip[0], "r");
+      missing = 1;
     }
+  }
+  // Input is traced, output is not
+  if (*rw == 'r')
+    ctx = traceOpen(fd, path, missing, &t0);
   else
-    return (void *) fd;
+    ctx = (void *) fd;
+  free(path);
+  return ctx;
 }
 
 int XRootClose (void * context) {
@@ -326,16 +569,34 @@ printf( "%s\n"
  *
  * Set last error level and last error message if applicable and available
  */
-void my_raise(VALUE obj, s_cleanup *clean, VALUE rbExcep, char *err)
+void my_raise(VALUE obj, s_cleanup *clean, VALUE rbExcep, const char *err)
 {
   xmlErrorPtr xmlErr = NULL;
   VALUE hErr;
+  s_xmemusage usage;
   
   if (!NIL_P(obj))
   {
     xmlErr = xmlGetLastError();
     hErr = rb_hash_new();
-    if (xmlErr)
+    if (g_stopped)
+    {
+      // One of our limits, libxslt might have complained on the way out, ignore it
+      rb_hash_aset(hErr, rb_str_new2("xmlErrCode"), INT2FIX(g_stopped));
+      rb_hash_aset(hErr, rb_str_new2("xmlErrLevel"), INT2FIX(XML_ERR_FATAL));
+      switch (g_stopped)
+      {
+        case XSL_ERR_DEADLINE:
+          rb_hash_aset(hErr, rb_str_new2("xmlErrMsg"), rb_str_new2("Transform stopped, deadline passed"));
+          break;
+        case XSL_ERR_MAXDEPTH:
+          rb_hash_aset(hErr, rb_str_new2("xmlErrMsg"), rb_sprintf("Transform stopped, more than %d nested templates", g_maxDepth));
+          break;
+        default:
+          rb_hash_aset(hErr, rb_str_new2("xmlErrMsg"), rb_sprintf("Transform stopped, more than %d documents", g_maxDocs));
+      }
+    }
+    else if (xmlErr)
     {
       // It seems we usually get a \n at the end of the msg, get rid of it
       if (*(xmlErr->message+strlen(xmlErr->message)-1) == '\n')
@@ -360,12 +621,26 @@ void my_raise(VALUE obj, s_cleanup *clean, VALUE rbExcep, char *err)
     dumpCleanup("Freeing pointers", *clean);
 #endif
     free(clean->params);
+    if (clean->ctxt)
+      xsltFreeTransformContext(clean->ctxt);
     xmlFree(clean->docstr);
     xmlFreeDoc(clean->docres);
     xmlFreeDoc(clean->docxml);
     //xmlFreeDoc(clean->docxsl);  segfault /\/ Veillard said xsltFreeStylesheet(xsl) does it
     xsltFreeStylesheet(clean->xsl);
   }
+  // Lift our limits
+  g_ctxt = NULL;
+  xsltSetDebuggerStatus(XSLT_DEBUG_NONE);
+
+  // Every traced file has been closed by now
+  traceEnd(obj);
+
+  // Measure the transform now that its trees are freed, before the cleanup below gives back libxml2's globals too
+  xmem_usage(&usage);
+  g_lastDelta = (long) usage.live - (long) usage.markLive;
+  g_lastPeak = (long) (usage.markPeak - usage.markLive);
+
   // Clean up xml stuff
   xmlCleanupInputCallbacks();
   xmlCleanupOutputCallbacks();
@@ -375,6 +650,39 @@ void my_raise(VALUE obj, s_cleanup *clean, VALUE rbExcep, char *err)
   xmlCleanupParser();
   xsltSetGenericErrorFunc(NULL, NULL);
 
+  // Release the arena in one go now that libxml is done with it
+  if (xmem_arena_active())
+  {
+    s_xmemstats stats;
+    VALUE hMem;
+    long rssArena = xmem_rss();
+
+    xmem_arena_end(&stats);
+    if (!NIL_P(obj))
+    {
+      hMem = rb_hash_new();
+      rb_hash_aset(hMem, rb_str_new2("allocs"),     ULONG2NUM(stats.allocs));
+      rb_hash_aset(hMem, rb_str_new2("frees"),      ULONG2NUM(stats.frees));
+      rb_hash_aset(hMem, rb_str_new2("reallocs"),   ULONG2NUM(stats.reallocs));
+      rb_hash_aset(hMem, rb_str_new2("bytes"),      ULONG2NUM(stats.bytes));
+      rb_hash_aset(hMem, rb_str_new2("chunks"),     ULONG2NUM(stats.chunks));
+      rb_hash_aset(hMem, rb_str_new2("chunkBytes"), ULONG2NUM(stats.chunkBytes));
+      rb_hash_aset(hMem, rb_str_new2("reuses"),     ULONG2NUM(stats.reuses));
+      rb_hash_aset(hMem, rb_str_new2("overflows"),  ULONG2NUM(stats.overflows));
+      rb_hash_aset(hMem, rb_str_new2("rssBefore"),  LONG2NUM(g_rssBefore));
+      rb_hash_aset(hMem, rb_str_new2("rssArena"),   LONG2NUM(rssArena));
+      rb_hash_aset(hMem, rb_str_new2("rssAfter"),   LONG2NUM(xmem_rss()));
+      rb_iv_set(obj, "@xmem", hMem);
+    }
+  }
+
+  // Tell ruby's GC how much memory libxml2 holds behind its back
+  xmem_usage(&usage);
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  rb_gc_adjust_memory_usage((ssize_t) usage.live - (ssize_t) g_gcReported);
+#endif
+  g_gcReported = usage.live;
+
   // Reset global variables to let ruby's GC do its work
   g_xroot = Qnil;
   g_xfiles = Qnil;
@@ -405,8 +713,10 @@ void my_register_xml(void)
 /* NO NEED xmlRegisterInputCallbacks(xmlIOHTTPMatch, xmlIOHTTPOpen, xmlIOHTTPRead, xmlIOHTTPClose);
 xmlRegisterInputCallbacks(xmlFileMatch, xmlFileOpen, xmlFileRead, xmlFileClose);*/
 
-  // Add our own file input callback
-  if (xmlRegisterInputCallbacks(XRootMatch, XRootInputOpen, xmlFileRead, XRootClose) < 0)
+  // Add our own file input callback, files that are traced have their own context
+  if (xmlRegisterInputCallbacks(XRootMatch, XRootInputOpen,
+                                Qtrue == g_xtrace ? XTraceRead : xmlFileRead,
+                                Qtrue == g_xtrace ? XTraceClose : XRootClose) < 0)
   {
     rb_raise(rb_eSystemCallError, "Failed to register input callbacks");
   }
@@ -591,6 +901,30 @@ char *build_params(VALUE rbparams)
 
 
 
+/*
+ *  Build array of the names of top-level xsl:param's declared by a compiled stylesheet
+ *  and by all the stylesheets it includes or imports
+ */
+VALUE declared_params(xsltStylesheetPtr xsl)
+{
+  VALUE ret = rb_ary_new();
+  VALUE name;
+  xsltStylesheetPtr style;
+  xsltStackElemPtr elem;
+
+  for (style = xsl; style != NULL; style = xsltNextImport(style))
+    for (elem = style->variables; elem != NULL; elem = elem->next)
+      if (elem->comp && elem->comp->type == XSLT_FUNC_PARAM && elem->name)
+      {
+        name = rb_str_new2((const char *)elem->name);
+        if (Qtrue != rb_funcall(ret, id.include, 1, name))
+          rb_ary_push(ret, name);
+      }
+
+  return ret;
+}
+
+
 /*
  *   Parse stylesheet and xml document, apply stylesheet and return result
  */
@@ -599,7 +933,7 @@ VALUE xsl_process_real(VALUE none, VALUE self)
   s_cleanup myPointers;
   int docstrlen;
   
-  VALUE rbxml, rbxsl, rbout, rbparams, rbxroot;
+  VALUE rbxml, rbxsl, rbout, rbparams, rbxroot, rbdeadline;
 
   // Get instance data in a reliable format
   rbxml = rb_iv_get(self, "@xml");
@@ -621,11 +955,44 @@ VALUE xsl_process_real(VALUE none, VALUE self)
   if (!NIL_P(rbxroot))
     g_xroot = StringValue(rbxroot);
   g_xtrack = RTEST(rb_iv_get(self, "@xtrack")) ? Qtrue : Qfalse;
+  g_xtrace = RTEST(rb_iv_get(self, "@xtrace")) ? Qtrue : Qfalse;
+  g_traceNr = 0;
   g_xfiles = rb_ary_new();
   g_xmsg = rb_ary_new();
 
+  // Set up our limits, the deadline has been turned into a CLOCK_MONOTONIC time by xsl_process
+  g_ctxt = NULL;
+  g_stopped = 0;
+  g_docs = 0;
+  g_ticks = 0;
+  g_maxDepth = NUM2INT(rb_iv_get(self, "@xmaxdepth"));
+  g_maxDocs = NUM2INT(rb_iv_get(self, "@xmaxdocs"));
+  memset(&g_deadline, '\0', sizeof(g_deadline));
+  rbdeadline = rb_iv_get(self, "@xdeadline");
+  if (!NIL_P(rbdeadline))
+  {
+    double d = NUM2DBL(rbdeadline);
+    g_deadline.tv_sec = (time_t) d;
+    g_deadline.tv_nsec = (long) ((d - (double) g_deadline.tv_sec) * 1e9);
+    if (g_deadline.tv_sec == 0)
+      g_deadline.tv_nsec = 1;   // Way in the past, but not 'no deadline'
+  }
+
   // Register callbacks and stuff
+  xmem_mark();
   my_register_xml();
+  rb_iv_set(self, "@xdeclared", Qnil);
+
+  // Allocate all per-transform trees from the arena if requested.
+  // Make sure libxml2 & libxslt globals are set up beforehand so they stay on the heap
+  rb_iv_set(self, "@xmem", Qnil);
+  if (Qtrue == g_xarena)
+  {
+    g_rssBefore = xmem_rss();
+    xmlInitParser();
+    xsltInit();
+    xmem_arena_begin(g_xarenaMax);
+  }
 
   // Make sure our pointers are all NULL
   memset(&myPointers, '\0', sizeof(myPointers));
@@ -662,6 +1029,9 @@ VALUE xsl_process_real(VALUE none, VALUE self)
     }
   }
 
+  // Let caller know which params the stylesheet can use
+  rb_iv_set(self, "@xdeclared", declared_params(myPointers.xsl));
+
   // Parse XML 
   if (looksLikeXML(rbxml))
   {
@@ -682,8 +1052,32 @@ VALUE xsl_process_real(VALUE none, VALUE self)
     }
   }
 
-  // Apply stylesheet to xml
-  myPointers.docres = xsltApplyStylesheet(myPointers.xsl, myPointers.docxml, (void*)myPointers.params);
+  // Apply stylesheet to xml, in a context of our own so that our limits can stop it.
+  // The debugger status must be on when the context is created for libxslt to call xslLimitsHandler
+  if (g_maxDepth || g_deadline.tv_sec || g_deadline.tv_nsec)
+    xsltSetDebuggerStatus(XSLT_DEBUG_RUN);
+  myPointers.ctxt = xsltNewTransformContext(myPointers.xsl, myPointers.docxml);
+  if (myPointers.ctxt == NULL)
+  {
+    my_raise(self, &myPointers, rb_eSystemCallError, "Cannot create transform context");
+    return Qnil;
+  }
+  // Let our own limit on nested templates apply even if it's higher than libxslt's
+  if (g_maxDepth >= myPointers.ctxt->maxTemplateDepth)
+    myPointers.ctxt->maxTemplateDepth = g_maxDepth + 1;
+  if (deadlinePassed())
+    stopTransform(XSL_ERR_DEADLINE);
+  else
+  {
+    g_ctxt = myPointers.ctxt;
+    myPointers.docres = xsltApplyStylesheetUser(myPointers.xsl, myPointers.docxml, (const char **)myPointers.params, NULL, NULL, myPointers.ctxt);
+    g_ctxt = NULL;
+  }
+  if (g_stopped)
+  {
+    my_raise(self, &myPointers, rb_eSystemCallError, "Transform stopped");
+    return Qnil;
+  }
   if (myPointers.docres == NULL)
   {
     my_raise(self, &myPointers, rb_eSystemCallError, "Stylesheet apply error");
@@ -711,9 +1105,63 @@ static VALUE in_sync(VALUE self)
   return rb_funcall(self, id.synchronize, 0);
 }
 
-VALUE xsl_process(VALUE self)
+// Ruby exceptions raised from within our callbacks (or a Timeout) skip my_raise,
+// make sure our limits are lifted, the trace is forgotten and the arena is switched off all the same
+static VALUE process_body(VALUE self)
+{
+  return xsl_process_real(Qnil, self);
+}
+
+static VALUE process_ensure(VALUE self)
+{
+  g_ctxt = NULL;
+  xsltSetDebuggerStatus(XSLT_DEBUG_NONE);
+  traceEnd(Qnil);
+  if (xmem_arena_active())
+    my_raise(Qnil, NULL, Qnil, NULL);
+  return Qnil;
+}
+
+static VALUE process_sync(VALUE none, VALUE self)
+{
+  return rb_ensure(process_body, self, process_ensure, self);
+}
+
+/*
+ *   process(deadline: nil)
+ *
+ *   deadline is either a Time or a number of seconds from now
+ *   Time spent waiting for other threads to finish their transforms counts
+ */
+VALUE xsl_process(int argc, VALUE *argv, VALUE self)
 {
-  return rb_iterate(in_sync, g_mutex, xsl_process_real, self);
+  VALUE opts, deadline = Qundef;
+  ID keywords[1];
+  struct timespec now;
+  double d;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (!NIL_P(opts))
+  {
+    keywords[0] = rb_intern("deadline");
+    rb_get_kwargs(opts, keywords, 0, 1, &deadline);
+  }
+  if (deadline == Qundef || NIL_P(deadline))
+    rb_iv_set(self, "@xdeadline", Qnil);
+  else
+  {
+    // Turn it into a CLOCK_MONOTONIC time that the clock can be compared with
+    if (rb_obj_is_kind_of(deadline, rb_cTime))
+    {
+      clock_gettime(CLOCK_REALTIME, &now);
+      d = NUM2DBL(rb_funcall(deadline, id.to_f, 0)) - (now.tv_sec + now.tv_nsec/1e9);
+    }
+    else
+      d = NUM2DBL(deadline);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rb_iv_set(self, "@xdeadline", rb_float_new(now.tv_sec + now.tv_nsec/1e9 + d));
+  }
+  return rb_iterate(in_sync, g_mutex, process_sync, self);
 }
 
 /*
@@ -748,6 +1196,110 @@ VALUE xsl_xfiles_get( VALUE self )
   return rb_iv_get(self, "@xfiles");
 }
 
+/*
+ *     @xdeclared
+ */
+VALUE xsl_xdeclared_get( VALUE self )
+{
+  return rb_iv_get(self, "@xdeclared");
+}
+
+/*
+ *     @xmem
+ */
+VALUE xsl_xmem_get( VALUE self )
+{
+  return rb_iv_get(self, "@xmem");
+}
+
+/*
+ *     @xmaxdepth
+ */
+VALUE xsl_xmaxdepth_set( VALUE self, VALUE max )
+{
+  // nil or 0 means no limit
+  rb_iv_set(self, "@xmaxdepth", NIL_P(max) ? INT2FIX(0) : INT2NUM(NUM2INT(max)));
+
+  return max;
+}
+
+VALUE xsl_xmaxdepth_get( VALUE self )
+{
+  return rb_iv_get(self, "@xmaxdepth");
+}
+
+/*
+ *     @xmaxdocs
+ */
+VALUE xsl_xmaxdocs_set( VALUE self, VALUE max )
+{
+  // nil or 0 means no limit
+  rb_iv_set(self, "@xmaxdocs", NIL_P(max) ? INT2FIX(0) : INT2NUM(NUM2INT(max)));
+
+  return max;
+}
+
+VALUE xsl_xmaxdocs_get( VALUE self )
+{
+  return rb_iv_get(self, "@xmaxdocs");
+}
+
+/*
+ *     arena (class-wide)
+ */
+VALUE xsl_arena_set( VALUE klass, VALUE onoff )
+{
+  g_xarena = RTEST(onoff) ? Qtrue : Qfalse;
+
+  return onoff;
+}
+
+VALUE xsl_arena_get( VALUE klass )
+{
+  return g_xarena;
+}
+
+/*
+ *     arena_max (class-wide), 0 means no limit
+ */
+VALUE xsl_arena_max_set( VALUE klass, VALUE max )
+{
+  long m = NUM2LONG(max);
+
+  if (m < 0)
+    rb_raise(rb_eArgError, "arena_max must be >= 0");
+  g_xarenaMax = (size_t) m;
+
+  return max;
+}
+
+VALUE xsl_arena_max_get( VALUE klass )
+{
+  return ULONG2NUM(g_xarenaMax);
+}
+
+/*
+ *     memory_stats (class-wide)
+ *
+ *   Memory held by libxml2 & libxslt in this process and by the last transform
+ *   Bytes are 0 when the platform cannot tell the size of a heap block
+ */
+VALUE xsl_memory_stats( VALUE klass )
+{
+  s_xmemusage usage;
+  VALUE hMem = rb_hash_new();
+
+  xmem_usage(&usage);
+  rb_hash_aset(hMem, rb_str_new2("live"),      ULONG2NUM(usage.live));
+  rb_hash_aset(hMem, rb_str_new2("peak"),      ULONG2NUM(usage.peak));
+  rb_hash_aset(hMem, rb_str_new2("allocs"),    ULONG2NUM(usage.allocs));
+  rb_hash_aset(hMem, rb_str_new2("frees"),     ULONG2NUM(usage.frees));
+  rb_hash_aset(hMem, rb_str_new2("lastDelta"), LONG2NUM(g_lastDelta));
+  rb_hash_aset(hMem, rb_str_new2("lastPeak"),  LONG2NUM(g_lastPeak));
+  rb_hash_aset(hMem, rb_str_new2("rss"),       LONG2NUM(xmem_rss()));
+  return hMem;
+}
+
 /*
  *     @xparams
  */
@@ -798,6 +1350,29 @@ VALUE xsl_xtrack_get( VALUE self )
   return rb_iv_get(self, "@xtrack");
 }
 
+/*
+ *     @xtrace
+ */
+VALUE xsl_xtrace_set( VALUE self, VALUE xtrace )
+{
+  rb_iv_set(self, "@xtrace", RTEST(xtrace) ? Qtrue : Qfalse);
+
+  return xtrace;
+}
+
+VALUE xsl_xtrace_get( VALUE self )
+{
+  return rb_iv_get(self, "@xtrace");
+}
+
+/*
+ *     @xio
+ */
+VALUE xsl_xio_get( VALUE self )
+{
+  return rb_iv_get(self, "@xio");
+}
+
 /*
  *     @xml
  */
@@ -844,7 +1419,14 @@ static VALUE xsl_init(VALUE self)
   rb_iv_set(self, "@xparams", Qnil);
   rb_iv_set(self, "@xroot", Qnil);
   rb_iv_set(self, "@xtrack", Qfalse);
+  rb_iv_set(self, "@xtrace", Qfalse);
+  rb_iv_set(self, "@xio", Qnil);
   rb_iv_set(self, "@xerr", Qnil);
+  rb_iv_set(self, "@xmem", Qnil);
+  rb_iv_set(self, "@xdeclared", Qnil);
+  rb_iv_set(self, "@xdeadline", Qnil);
+  rb_iv_set(self, "@xmaxdepth", INT2FIX(0));
+  rb_iv_set(self, "@xmaxdocs", INT2FIX(0));
 
   return self;
 }
@@ -869,6 +1451,7 @@ void Init_xsl( void )
   id.include     = rb_intern("include?");
   id.to_a        = rb_intern("to_a");
   id.to_s        = rb_intern("to_s");
+  id.to_f        = rb_intern("to_f");
   id.length      = rb_intern("length");
   id.synchronize = rb_intern("synchronize");
   
@@ -878,6 +1461,19 @@ void Init_xsl( void )
   rb_global_variable(&g_xmsg);
   rb_global_variable(&g_xroot);
 
+  // Use our own memory functions, see xmem.c
+  xmem_init();
+
+  // Count the documents loaded by document(), see xslDocLoader
+  g_docLoader = xsltDocDefaultLoader;
+  xsltSetLoaderFunc(xslDocLoader);
+
+  // Hook into libxslt's debugger to enforce our limits, it's only called when its status is on
+  {
+    static void *limitsCallbacks[3] = { (void *) xslLimitsHandler, NULL, NULL };
+    xsltSetDebuggerCallbacks(3, limitsCallbacks);
+  }
+
   rb_define_const( cXSL, "ENGINE_VERSION",    rb_str_new2(xsltEngineVersion) );
   rb_define_const( cXSL, "LIBXSLT_VERSION",   INT2NUM(xsltLibxsltVersion) );
   rb_define_const( cXSL, "LIBXML_VERSION",    INT2NUM(xsltLibxmlVersion) );
@@ -886,9 +1482,18 @@ void Init_xsl( void )
   rb_define_const( cXSL, "DEFAULT_VERSION",   rb_str_new2(XSLT_DEFAULT_VERSION) );
   rb_define_const( cXSL, "DEFAULT_URL",       rb_str_new2(XSLT_DEFAULT_URL) );
   rb_define_const( cXSL, "NAMESPACE_LIBXSLT", rb_str_new2(XSLT_LIBXSLT_NAMESPACE) );
+  rb_define_const( cXSL, "ERR_DEADLINE",      INT2NUM(XSL_ERR_DEADLINE) );  // xmlErrCode of transforms stopped by our limits
+  rb_define_const( cXSL, "ERR_MAXDEPTH",      INT2NUM(XSL_ERR_MAXDEPTH) );
+  rb_define_const( cXSL, "ERR_MAXDOCS",       INT2NUM(XSL_ERR_MAXDOCS) );
 
   rb_define_method( cXSL, "initialize", xsl_init, 0 );
 
+  rb_define_singleton_method( cXSL, "arena?", xsl_arena_get, 0 ); // Are per-transform trees allocated from an arena
+  rb_define_singleton_method( cXSL, "arena=", xsl_arena_set, 1 ); // Allocate per-transform trees from an arena released after each process
+  rb_define_singleton_method( cXSL, "arena_max",  xsl_arena_max_get, 0 ); // Most bytes the arena maps per transform
+  rb_define_singleton_method( cXSL, "arena_max=", xsl_arena_max_set, 1 ); // Set it, 0 for no limit
+  rb_define_singleton_method( cXSL, "memory_stats", xsl_memory_stats, 0 ); // Bytes held by libxml2 now, at peak, and by the last process, RSS in KB
+
   rb_define_method( cXSL, "xmsg",     xsl_xmsg_get,    0 ); // Return array of '%%GORG%%.*' strings returned by the XSL transform with <xsl:message>
   rb_define_method( cXSL, "xfiles",   xsl_xfiles_get,  0 ); // Return array of names of all files that libxml2 opened during last process
   rb_define_method( cXSL, "xparams",  xsl_xparams_get, 0 ); // Return hash of params
@@ -897,11 +1502,20 @@ void Init_xsl( void )
   rb_define_method( cXSL, "xroot=",   xsl_xroot_set,   1 ); // See the root dir as a $DocumentRoot
   rb_define_method( cXSL, "xtrack?",  xsl_xtrack_get,  0 ); // Should I track the files that libxml2 opens
   rb_define_method( cXSL, "xtrack=",  xsl_xtrack_set,  1 ); // Track the files that libxml2 opens, or not
+  rb_define_method( cXSL, "xtrace?",  xsl_xtrace_get,  0 ); // Should I time the files that libxml2 reads
+  rb_define_method( cXSL, "xtrace=",  xsl_xtrace_set,  1 ); // Trace opens, bytes read and time spent per file, or not
+  rb_define_method( cXSL, "xio",      xsl_xio_get,     0 ); // Return array of {"path", "opens", "bytes", "time", "missing"} of last process when traced
   rb_define_method( cXSL, "xml",      xsl_xml_get,     0 );
   rb_define_method( cXSL, "xml=",     xsl_xml_set,     1 );
   rb_define_method( cXSL, "xsl",      xsl_xsl_get,     0 );
   rb_define_method( cXSL, "xsl=",     xsl_xsl_set,     1 );
   rb_define_method( cXSL, "xerr",     xsl_xerr_get,    0 );
   rb_define_method( cXSL, "xres",     xsl_xres_get,    0 );
-  rb_define_method( cXSL, "process",  xsl_process,     0 );
+  rb_define_method( cXSL, "xdeclared", xsl_xdeclared_get, 0 ); // Return array of names of top-level xsl:param's declared by the last stylesheet
+  rb_define_method( cXSL, "xmem",     xsl_xmem_get,    0 ); // Arena statistics of last process, nil when no arena is used
+  rb_define_method( cXSL, "xmaxdepth",  xsl_xmaxdepth_get, 0 ); // Max number of nested templates, 0 means no limit
+  rb_define_method( cXSL, "xmaxdepth=", xsl_xmaxdepth_set, 1 ); // Stop transforms that nest more templates than that
+  rb_define_method( cXSL, "xmaxdocs",   xsl_xmaxdocs_get,  0 ); // Max number of files opened with document(), 0 means no limit
+  rb_define_method( cXSL, "xmaxdocs=",  xsl_xmaxdocs_set,  1 ); // Stop transforms that open more files than that
+  rb_define_method( cXSL, "process",  xsl_process,    -1 ); // process(deadline: Time or seconds from now), stop the transform when it's passed
 }
@@ -22,6 +22,7 @@
 #define __XSL_H__
 
 #include <sys/stat.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <ruby.h>
@@ -31,16 +32,88 @@
 #include <libxslt/extra.h>
 #include <libxslt/xsltutils.h>
 #include <libxslt/transform.h>
+#include <libxslt/imports.h>
+#include <libxslt/documents.h>
 
 typedef struct S_cleanup
 {
   char *params;
   xmlDocPtr docxml, docxsl, docres;
   xsltStylesheetPtr xsl;
+  xsltTransformContextPtr ctxt;
   xmlChar *docstr;
 }
 s_cleanup;
 
+/*
+ *  I/O trace of a transform, see XRootOpen & xtrace=
+ *  One entry per file, the input context of a traced file points to its s_traced
+ */
+typedef struct S_trace
+{
+  char *path;                   // Resolved path
+  long opens;
+  long bytes;                   // Bytes read
+  double time;                  // Seconds spent opening, reading & closing it
+  int missing;                  // Placeholder returned for a missing file
+}
+s_trace;
+
+typedef struct S_traced
+{
+  FILE *fd;
+  int entry;                    // Index in the trace
+}
+s_traced;
+
+/*
+ *  xmlErrCode reported in @xerr when a transform has been stopped by one of our limits
+ *  They do not clash with libxml2 & libxslt error codes
+ */
+#define XSL_ERR_DEADLINE  9901  // Deadline passed
+#define XSL_ERR_MAXDEPTH  9902  // Too many nested templates
+#define XSL_ERR_MAXDOCS   9903  // Too many files opened with document()
+
+/*
+ *  Arena statistics, see xmem.c
+ */
+typedef struct S_xmemstats
+{
+  size_t allocs, frees, reallocs;
+  size_t reuses;                // Allocations served from a freed block
+  size_t overflows;             // Allocations that went to the heap, the arena being full
+  size_t bytes;                 // Bytes requested by libxml2
+  size_t chunks, chunkBytes;    // Chunks actually mmap'ed
+}
+s_xmemstats;
+
+/*
+ *  Memory held by libxml2 & libxslt, see xmem.c
+ *  Bytes are 0 when the platform cannot tell the size of a heap block
+ */
+typedef struct S_xmemusage
+{
+  size_t live, peak;            // Bytes held now and at most since the process started
+  size_t allocs, frees;         // Heap blocks
+  size_t markLive, markPeak;    // Bytes held when xmem_mark was called and at most since then
+}
+s_xmemusage;
+
+void  xmem_init(void);
+void *xmem_malloc(size_t size);
+void  xmem_free(void *ptr);
+void *xmem_realloc(void *ptr, size_t size);
+char *xmem_strdup(const char *str);
+// Default ceiling of the arena, blocks come from the heap beyond it
+#define XMEM_ARENA_MAX (64*1024*1024)
+
+void  xmem_arena_begin(size_t max);
+void  xmem_arena_end(s_xmemstats *stats);
+int   xmem_arena_active(void);
+long  xmem_rss(void);
+void  xmem_mark(void);
+void  xmem_usage(s_xmemusage *u);
+
 #define XSL_VERSION  "0.1"
 
 #endif
@@ -35,7 +35,7 @@ require 'ipaddr'
 
 module Gorg
 
-  def xproc(path, params, list=false, printredirect=false)
+  def xproc(path, params, list=false, printredirect=false, deadline=nil)
     # Process file through xslt passing params to the processor
     # path should be the absolute path of the file, i.e. not relative to DocumentRoot
     #
@@ -45,6 +45,9 @@ module Gorg
     # Use default stylesheet if none can be found in the file
     # Return a list of files read by the processor (useful to do caching) if requested
     #
+    # Stop all transforms once deadline (a Time) has passed,
+    # it defaults to xslTimeout seconds from now if that is set
+    #
     # Return an error condition and, hopefully, some useful output
     # Do not raise any exception
     # In most cases, an error will result in no output but
@@ -65,17 +68,28 @@ module Gorg
     #    paths are absolute, i.e. not relative to your docroot.
     #    Each entry is an array [access type, path] with access_type being
     #      "r" for read, "w" for written (with exsl:document) or "o" for other (ftp:// or http://)
-    # 4. array of CGI::Cookie to be sent back
+    # 4. array of strings output by the transform with <xsl:message>%%GORG%%...</xsl:message>
+    #    (e.g. Set-Cookie(name)key=value or Redirect=URI)
+    # 5. names of the top-level xsl:param's declared by the stylesheets, params passed
+    #    under any other name have no influence on the result
+    # 6. I/O trace when slowTime is set, i.e. for each file read by the processor
+    #    {"path", "opens", "bytes", "time", "missing"}, added up over all stylesheets, nil otherwise
     #
     # Examples: [{"xmlErrMsg"=>"blah warning blah", "xmlErrCode"=>1509, "xmlErrLevel"=>1}, "This is the best XSLT could do!", nil]
     #           [{"xmlErrCode"=>0}, "Result of XSLT processing. Well done!", ["/etc/xml/catalog","/var/www/localhost/htdocs/doc/en/index.xml","/var/www/localhost/htdocs/dtd/guide.dtd"]]
 
     xsltproc = Gorg::XSL.new
     xsltproc.xroot = $Config["root"]
+    # Stop runaway transforms
+    xsltproc.xmaxdepth = $Config["xslMaxDepth"]
+    xsltproc.xmaxdocs = $Config["xslMaxDocuments"]
+    deadline ||= Time.now + $Config["xslTimeout"] if $Config["xslTimeout"] > 0
     # Grab strings from xsl:message
     xslMessages = []
     # Does the caller want a list of accessed files?
     xsltproc.xtrack = list; filelist = Array.new
+    # Time what libxml2 reads for the slow request log
+    xsltproc.xtrace = $Config["slowTime"] > 0; trace = {}
     # Process .xml file with stylesheet(s) specified in file, or with default stylesheet
     xsltproc.xml = path
     # Look for stylesheet href (there can be more than one)
@@ -95,11 +109,39 @@ module Gorg
     styles << $Config["defaultXSL"] if styles.length == 0
     # Add params, we expect a hash of {param name => param value,...}
     xsltproc.xparams = params
+    # Names of the params declared by all stylesheets
+    declared = []
+    # Resume from the deepest intermediate result that is still valid in the stage cache
+    # The final stage is never stored there, it's the caller's business to cache the final output
+    stages = list && styles.length > 1 && Cache.stages? && FileTest.file?(path)
+    stageKey = path
+    if stages then
+      chain = []; chainNames = []
+      styles[0..-2].each { |style|
+        index = Cache.stageIndex(chain.last||path, style)
+        names = Cache.stageParams(index) or break
+        chain << Cache.stageKey(index, params, names)
+        chainNames << names
+      }
+      while chain.length > 0
+        if hit = Cache.stageHit(chain.last) then
+          debug "Resuming #{path} after stage #{chain.length}"
+          xsltproc.xml, filelist, xslMessages = hit
+          styles.shift(chain.length)
+          stageKey = chain.last
+          declared = chainNames.flatten
+          break
+        end
+        chain.pop; chainNames.pop
+      end
+    end
     # Process through list of stylesheets
     firstErr = {}
     while xsltproc.xsl = styles.shift
-      xsltproc.process
+      xsltproc.process(deadline: deadline)
+      debug "Arena for #{xsltproc.xsl}: #{xsltproc.xmem.inspect}" if xsltproc.xmem
       filelist += xsltproc.xfiles if xsltproc.xtrack?
+      addTrace(trace, xsltproc.xio) if xsltproc.xtrace?
       # Break and raise 301 on redirects
       xsltproc.xmsg.each { |r|
         if r =~ /Redirect=(.+)/ then
@@ -111,16 +153,26 @@ module Gorg
         end
       }
       xslMessages += xsltproc.xmsg
+      declared |= xsltproc.xdeclared||[]
       # Remember 1st warning / error
       firstErr = xsltproc.xerr if firstErr["xmlErrLevel"].nil? && xsltproc.xerr["xmlErrLevel"] > 0
       # B0rk on error, an exception should have been raised by the lib, but, er, well, you never know
       break if xsltproc.xerr["xmlErrLevel"] > 1 
+      # Keep clean intermediate results in the stage cache
+      if stages and styles.length > 0 then
+        index = Cache.stageIndex(stageKey, xsltproc.xsl)
+        if xsltproc.xerr["xmlErrLevel"] == 0 then
+          stageKey = Cache.stageStore(index, params, xsltproc.xdeclared, xsltproc.xres, filelist.uniq, xslMessages)
+        else
+          stageKey = Cache.stageKey(index, params, xsltproc.xdeclared||[])
+        end
+      end
       xsltproc.xml = xsltproc.xres
     end
     # Keep 1st warning / error if there has been one
     firstErr = xsltproc.xerr if firstErr["xmlErrLevel"].nil?
     # Return values
-    [ firstErr, xsltproc.xres, (filelist.uniq if xsltproc.xtrack?), xslMessages ]
+    [ firstErr, xsltproc.xres, (filelist.uniq if xsltproc.xtrack?), xslMessages, declared.uniq, (trace.values if xsltproc.xtrace?) ]
   rescue => ex
     if ex.respond_to?(:errCode) then
       # One of ours (Gorg::Status::HTTPStatus)
@@ -147,6 +199,64 @@ module Gorg
     end
   end
   
+  def addTrace(trace, xio)
+    # Add up the I/O trace of a stylesheet into trace {path => entry}
+    (xio||[]).each { |t|
+      if e = trace[t["path"]] then
+        e["opens"] += t["opens"]; e["bytes"] += t["bytes"]; e["time"] += t["time"]
+        e["missing"] ||= t["missing"]
+      else
+        trace[t["path"]] = t
+      end
+    }
+    trace
+  end
+
+  def logSlow(what, seconds, trace)
+    # Report a transform that took slowTime seconds or more to slowLog,
+    # with the files that took longest to read
+    return unless $Config["slowTime"] > 0 and seconds >= $Config["slowTime"]
+    trace ||= []
+    io = trace.inject(0){|a,t| a+t["time"]}
+    top = trace.sort_by{|t| -t["time"]}[0,5].collect{|t|
+      "#{t['path']} #{t['bytes']/1024}KB #{'%.3f' % t['time']}s#{" x#{t['opens']}" if t['opens'] > 1}#{' missing' if t['missing']}"
+    }
+    msg = "SLOW  #{what} #{'%.3f' % seconds}s, #{trace.length} files #{trace.inject(0){|a,t| a+t['bytes']}/1024}KB read in #{'%.3f' % io}s: #{top.join(', ')}"
+    if $Config["slowLog"] == "syslog" then
+      warn(msg)
+    else
+      File.open($Config["slowLog"], "a") { |f| f.puts("#{Time.now.strftime('%Y-%m-%d %H:%M:%S')} #{msg}") }
+    end
+  rescue StandardError => ex
+    warn("Cannot write to slow request log (#{ex})")
+  end
+
+  def xslStopped?(err)
+    # Has the transform been stopped by xslTimeout, xslMaxDepth or xslMaxDocuments
+    [Gorg::XSL::ERR_DEADLINE, Gorg::XSL::ERR_MAXDEPTH, Gorg::XSL::ERR_MAXDOCS].include?(err["xmlErrCode"])
+  end
+  
+  def revalidate(cacheName, path, xml_query, query)
+    # A stale cache entry has just been served, render it again in the background
+    # cacheName & query name the cache entry, path & xml_query are passed to xproc
+    Cache.refresh(cacheName, query) {
+      err, body, filelist, extrameta, declared = xproc(path, xml_query, true)
+      if err["xmlErrLevel"] > 0 then
+        warn("Stale #{cacheName} not refreshed: #{err.collect{|e|e.join(':')}.join('; ')}")
+      elsif (body||"").length > 0 then
+        Cache.store(body, cacheName, query, filelist, extrameta, declared)
+      end
+    }
+  end
+
+  def memoryExceeded
+    # Has this process grown over memoryLimit, return a message saying by how much or nil
+    return nil unless $Config["memoryLimit"] > 0
+    mem = Gorg::XSL.memory_stats
+    return nil unless mem["rss"] > $Config["memoryLimit"]*1024
+    "#{mem['rss']/1024}MB used, limit is #{$Config['memoryLimit']}MB (libxml2 holds #{mem['live']/1024}KB, peaked at #{mem['peak']/1024}KB)"
+  end
+
   # HTTP status codes and html output  
   module Status
     class HTTPStatus < StandardError
@@ -179,12 +289,20 @@ module Gorg
     end
     
     class NotModified < HTTPStatus
-      def initialize(stat)
+      # Cookies the page sets, they are sent again with the 304
+      attr_reader :cookies
+      # Request headers the page varies on, besides the URI
+      attr_accessor :vary
+      def initialize(stat, cookies=nil)
         # 304 needs to send ETag and Last-Modified back
         @mstat=stat
+        @cookies=cookies
       end
       def header
-        {'Last-Modified' => @mstat.mtime.httpdate.dup, 'ETag' => makeETag(@mstat).dup}.merge(super)
+        h = {'Last-Modified' => @mstat.mtime.httpdate.dup, 'ETag' => makeETag(@mstat).dup}.merge(super)
+        h['Vary'] = @vary if @vary
+        h['cookie'] = @cookies if @cookies
+        h
       end
       def html
         ""
@@ -258,6 +376,15 @@ module Gorg
       end
     end
     
+    class ServiceUnavailable < HTTPStatus
+      def errLabel
+        "Service Unavailable"
+      end
+      def errCode
+        503
+      end
+    end
+    
     class SysError    < HTTPStatus 
       def errLabel
         "Internal Server Error"
@@ -281,10 +408,14 @@ module Gorg
                 "defaultXSL" => nil,    # No default stylesheet, how could I guess?
                 "cacheDir" => nil,      # No cache by default. Directory must exist and be writable.
                 "cacheTTL" => 0,        # Number of seconds after which a document is considered too old, 0=never
+                "cacheStale" => 0,      # Number of seconds an entry can still be served after a change in a file it depends on was seen, 0=never
                 "cacheSize" => 40,      # in MegaBytes, max size of cache, used when autocleanig
                 "zipLevel" => 2,        # Compresion level used for gzip support (HTTP accept_encoding) (0-9, 0=none, 9=max)
                 "maxFiles" => 9999,     # Max number of files in a single directory in the cache tree
                 "cacheTree" => 0,       # Use same tree as on site in cache, 0 = disabled
+                "stageCache" => false,  # Cache intermediate results of multi-stage transforms
+                "cacheStore" => "files",# files (.Meta & .Data files) or packed (segment files + index)
+                "packedSlots" => 65536, # Max number of entries in the packed store index
                 "cacheWash" => 0,       # Clean cache automatically and regularly when a store into the cache occurs. 0 = disabled
                                         #  gorg cleans up if random(param_value) < 10. It will only clean same dir it caches to, not whole tree.
                                         # i.e. a value<=10 means at every call (not a good idea), 100 means once/10 stores, 1000 means once/100 stores
@@ -295,7 +426,20 @@ module Gorg
                 "HTTP_HOST" => nil,     # Pass host value from HTTP header to xsl transform
                 "accessLog" => "syslog",# or a filename or STDERR, used to report hits from WEBrick, not used by cgi's
                 "autoKill" => 0,        # Only used by fastCGI, exit after so many requests (0 means no, <=1000 means 1000). Just in case you fear memory leaks.
+                "memoryLimit" => 0,     # fastCGI exits, stand-alone server restarts when its RSS goes over so many MB, 0 = no limit
+                "slowTime" => 0,        # Report transforms that take so many seconds or more, with an I/O trace, 0 = never
+                "slowLog" => "syslog",  # or a filename, where they are reported
+                "daemonSocket" => nil,  # Unix socket gorg --daemon listens on, gorg.cgi & gorg -F forward their requests to it
+                "daemonWorkers" => 4,   # Number of processes gorg --daemon preforks
+                "daemonSocketMode" => 0660, # Who may connect to daemonSocket, i.e. have the daemon render files
+                "daemonSocketGroup" => nil, # Group of daemonSocket, e.g. the web server's
+                "xmlArena" => false,    # Allocate per-request xml trees from an arena that is released in one go
+                "xmlArenaMax" => 64,    # MB the arena may take per request, further trees go to the heap, 0 = no limit
+                "xslTimeout" => 0,      # Stop transforms after so many seconds, 0 = no limit
+                "xslMaxDepth" => 0,     # Stop transforms that nest more templates than that, 0 = no limit
+                "xslMaxDocuments" => 0, # Stop transforms that open more files with document(), 0 = no limit
                 "in/out" => [],         # (In/Ex)clude files from indexing
+                "indexFile" => nil,     # Search index built by gorg --index, unless dbConnect = sqlite:file
                 "mounts" => [],         # Extran mounts for stand-alone server
                 "listen" => "127.0.0.1" # Let webrick listen on given IP
             }
@@ -311,6 +455,10 @@ module Gorg
 
     # Init cache
     Cache.init($Config) if $Config["cacheDir"]
+
+    # Allocate xml trees from an arena
+    Gorg::XSL.arena = $Config["xmlArena"]
+    Gorg::XSL.arena_max = $Config["xmlArenaMax"]*1024*1024
     
     # Set requested log level
     $Log.level = $Config["logLevel"]
@@ -396,6 +544,8 @@ module Gorg
        h["cacheDir"] = value
       when "cachettl"
        h["cacheTTL"] = value.to_i
+      when "cachestale"
+       h["cacheStale"] = value.to_i
       when "cachesize"
        h["cacheSize"] = value.to_i
       when "maxfiles"
@@ -410,12 +560,44 @@ module Gorg
        end
       when "cachewash"
        h["cacheWash"] = value.to_i
+      when "stagecache"
+       h["stageCache"] = value.squeeze == "1"
+      when "cachestore"
+       raise "cacheStore must be files or packed" unless value =~ /^(files|packed)$/i
+       h["cacheStore"] = $1.downcase
+      when "packedslots"
+       h["packedSlots"] = value.to_i
       when "loglevel"
        h["logLevel"] = value.to_i
       when "accesslog"
        h["accessLog"] = value
       when "autokill"
        h["autoKill"] = value.to_i
+      when "memorylimit"
+       h["memoryLimit"] = value.to_i
+      when "slowtime"
+       h["slowTime"] = value.to_f
+      when "slowlog"
+       h["slowLog"] = value
+      when "daemonsocket"
+       h["daemonSocket"] = value
+      when "daemonworkers"
+       h["daemonWorkers"] = [value.to_i, 1].max
+      when "daemonsocketmode"
+       raise "daemonSocketMode must be an octal mode, e.g. 0660" unless value =~ /^[0-7]{3,4}$/
+       h["daemonSocketMode"] = value.oct
+      when "daemonsocketgroup"
+       h["daemonSocketGroup"] = value
+      when "xmlarena"
+       h["xmlArena"] = value.squeeze == "1"
+      when "xmlarenamax"
+       h["xmlArenaMax"] = [value.to_i, 0].max
+      when "xsltimeout"
+       h["xslTimeout"] = value.to_f
+      when "xslmaxdepth"
+       h["xslMaxDepth"] = value.to_i
+      when "xslmaxdocuments"
+       h["xslMaxDocuments"] = value.to_i
       when "listen"
        begin
          ip = IPAddr.new(value)
@@ -423,6 +605,8 @@ module Gorg
        rescue
          h["listen"] = "127.0.0.1"
        end
+      when "indexfile"
+        h["indexFile"] = value
       when "dbconnect"
         h["dbConnect"] = value
       when "dbuser"
@@ -577,7 +761,8 @@ module Gorg
  
   def makeETag(st)
     # Format file stat object into an ETag using its size & mtime
-    # Parameter can either be a filename or a stat object
+    # Parameter can either be a filename, a stat object or a cache manifest that has its own
+    return st.etag if st.respond_to?(:etag)
     st = File.stat(st) unless st.respond_to?(:ino)
     sprintf('"%x-%x"', st.size, st.mtime.to_i)
   end
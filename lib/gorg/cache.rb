@@ -33,12 +33,20 @@ require "fileutils"
 require "find"
 require "digest"
 require "digest/md5"
+require "stringio"
 
 module Gorg
 
 CacheStamp = "Gorg-#{Gorg::Version} Cached This Data. Do not alter this file. Thanks."
 
 module Cache
+  # What the dependencies recorded in a meta file say about a cache entry, without its data
+  #  . etag is a digest of the entry name and of its dependencies (files, sizes & mtimes)
+  #  . mtime is the latest mtime of the files it depends on
+  #  . size & sizeZ are the lengths of the data and of its gzipped version, nil if unknown
+  # makeETag & notModified? accept it in place of a File::Stat
+  Manifest = Struct.new(:etag, :mtime, :size, :sizeZ)
+
   def Cache.init(config)
     @@lockfile = ".cache.cleaner.lock"
     @cacheDir = nil
@@ -61,9 +69,23 @@ module Cache
     @maxSize = config["cacheSize"]*1024*1024  # Now in bytes
     @washNumber = config["cacheWash"]         # Clean cache dir after a store operation whenever rand(@washNumber) < 10
     @lastCleanup = Time.new-8e8               # Remember last time we started a cleanup so we don't pile them up
+    @stale = config["cacheStale"]             # Serve entries for so many seconds after a change in a file they depend on was seen
+    @stages = config["stageCache"]            # Also cache intermediate results of multi-stage transforms
+    @stageDir = "#{@cacheDir}/.stages" if @cacheDir
+
+    # Keep entries in a few segment files instead of a .Meta and a .Data file per entry
+    @packed = false
+    if @cacheDir and config["cacheStore"] == "packed" then
+      require "gorg/packed"
+      PackedCache.init(@cacheDir, @maxSize, @ttl, config["packedSlots"])
+      @packed = true
+    end
+  rescue StandardError => ex
+    warn "Packed cache unusable (#{ex}), using files"
+    @packed = false
   end
   
-  def Cache.hit(objPath, objParam={}, etags=nil, ifmodsince=nil)
+  def Cache.hit(objPath, objParam={}, etags=nil, ifmodsince=nil, anyAge=false)
     # objPath is typically a requested path passed from a web request but it
     # can be just any string. It is not checked against any actual files on the file system
     #
@@ -83,71 +105,76 @@ module Cache
     #   ifmodsince is a time object passed on an If-Modified-Since request field
     #   If the creation date of the meta file is earlier, no data is returned (webserver should return a 304)
 
+    # When a change in the files the entry depends on was first seen less than @stale seconds ago,
+    # the entry is still returned but flagged as stale, caller is expected to render it again with Cache.refresh
+    # anyAge lifts that delay, e.g. when rendering it again has just failed
+
     return nil if @cacheDir.nil? # Not initialized, ignore request
     
+    # Forget about params the stylesheets do not use
+    objParam = usedParams(objPath, objParam)
+
     # Reminder: filenames are full path, no need to prepend dirname
     dirname, basename, filename, metaname = makeNames(objPath, objParam)
     
-    raise "Cache subdir does not exist" unless FileTest.directory?(dirname)
+    if @packed then
+      # Meta and data are stored together, the data is only read if needed
+      entry = PackedCache.get(filename)
+      raise "Not in packed cache" if entry.nil?
+      meta, fstat = entry.meta, entry.stat
+    else
+      raise "Cache subdir does not exist" unless FileTest.directory?(dirname)
 
-    # Hit the cache
-    meta, mstat = IO.read(metaname), File.stat(metaname)  if metaname && FileTest.file?(metaname) && FileTest.readable?(metaname)
-    raise "Empty/No meta file" if meta.nil? || meta.length < 1
+      # Hit the cache
+      meta, mstat = IO.read(metaname), File.stat(metaname)  if metaname && FileTest.file?(metaname) && FileTest.readable?(metaname)
+      raise "Empty/No meta file" if meta.nil? || meta.length < 1
 
-    fstat = File.stat(filename) if filename && FileTest.file?(filename)
-    raise "Empty/No data file" if fstat.nil?
+      fstat = File.stat(filename) if filename && FileTest.file?(filename)
+      raise "Empty/No data file" if fstat.nil?
+    end
 
     # Check the timestamps of files in the metadata
-    meta = meta.split("\n")
-    raise "I did not write that meta file" unless CacheStamp == meta.shift
-    mline = meta.shift
-    while mline and mline !~ /^;;extra meta$/ do
-      f, s, d = mline.split(";;")
-      if s.to_i < 0
-        # File did not exist when cache entry was created
-        raise "Required file #{f} has (re)appeared" if FileTest.file?(f) && FileTest.readable?(f)
-      else
-        # File did exist when cache entry was created, is it still there?
-        raise "Required file #{f} has disappeared" unless FileTest.file?(f) && FileTest.readable?(f)
-      
-        fst = File.stat(f)
-        raise "Size of #{f} has changed from #{fst.size} to #{s.to_i}" unless fst.size == s.to_i
-        if $haveparsedate
-          raise "Timestamp of #{f} has changed" unless Time.utc(*ParseDate.parsedate(d)) == fst.mtime.utc
-        else
-          raise "Timestamp of #{f} has changed" unless Time.parse(d) == fst.mtime.utc
-        end
-      end
-      mline = meta.shift
-    end
-    if mline =~ /^;;extra meta$/ then
-      extrameta = meta.dup
-    else
-      extrameta = []
-    end
+    changed = [] if @stale > 0 or anyAge
+    extrameta = checkDeps(meta, changed)
+    stale = !changed.nil? && changed.length > 0
+    raise "Stale for more than #{@stale} seconds" if stale and not anyAge and Time.now - staleSince(filename) > @stale
     
-    if notModified?(fstat, etags, ifmodsince) and extrameta.join !~ /set-cookie/i
-      raise Gorg::Status::NotModified.new(fstat)
+    # ETag & Last-Modified only depend on the meta data
+    mstat = manifestOf(objPath, objParam, meta, fstat)
+
+    # A stale entry is not worth a 304, the client will need the new version soon enough
+    # Cookies set by the page go out with the 304, they are part of the meta data, not of the page
+    if not stale and notModified?(mstat, etags, ifmodsince)
+      raise Gorg::Status::NotModified.new(mstat, makeCookies(extrameta))
     end
     
-    file = IO.read(filename) if filename && FileTest.file?(filename) && FileTest.readable?(filename)
+    if @packed then
+      file = entry.data
+    else
+      file = IO.read(filename) if filename && FileTest.file?(filename) && FileTest.readable?(filename)
+    end
     raise "Empty/No data file" if file.nil? || file.length < 1
 
-    # Is the data file too old
-    raise "Data file too old" unless @ttl==0 or (Time.new - fstat.mtime) < @ttl
+    # Is the data file too old, any age will do if we were told so
+    raise "Data file too old" unless anyAge or @ttl==0 or (Time.new - fstat.mtime) < @ttl
     
     # Update atime of files, ignore failures as files might have just been removed
     begin
-      t = Time.new
-      File.utime(t, fstat.mtime, filename)
-      File.utime(t, mstat.mtime, metaname)
+      if @packed then
+        entry.touch
+      else
+        t = Time.new
+        File.utime(t, fstat.mtime, filename)
+        File.utime(t, mstat.mtime, metaname)
+      end
     rescue
       nil
     end
     
-    # If we get here, it means the data file can be used, return cache object (data, stat(datafile), extrameta)
+    # If we get here, it means the data file can be used, return cache object (data, manifest, extrameta, stale)
     # The file is left (un)compressed, it's returned as it was stored
-    [file, fstat, extrameta]
+    debug("Serving stale #{objPath}") if stale
+    [file, mstat, extrameta, stale]
     
   rescue Gorg::Status::NotModified
     # Nothing changed, should return a 304
@@ -160,15 +187,53 @@ module Cache
   end
 
 
-  def Cache.store(data, objPath, objParam={}, deps=[], extrameta=[])
+  def Cache.manifest(objPath, objParam={}, etags=nil, ifmodsince=nil)
+    # Same as hit but only look at the meta data, i.e. the data is neither read
+    # nor required to be there anymore (it might have been washed away)
+    # Return [Manifest, extrameta] for a webserver to answer a HEAD request,
+    # raise NotModified if the client's copy is up-to-date, or return nil
+    # when the dependencies have changed in any way, stale entries are left to hit
+    return nil if @cacheDir.nil? # Not initialized, ignore request
+
+    objParam = usedParams(objPath, objParam)
+    _, _, filename, metaname = makeNames(objPath, objParam)
+    if @packed then
+      entry = PackedCache.get(filename)
+      raise "Not in packed cache" if entry.nil?
+      meta = entry.meta
+    else
+      meta = IO.read(metaname)
+    end
+    extrameta = checkDeps(meta)
+    mstat = manifestOf(objPath, objParam, meta)
+    raise "Data file too old" unless @ttl==0 or (Time.new - mstat.mtime) < @ttl
+
+    if notModified?(mstat, etags, ifmodsince)
+      raise Gorg::Status::NotModified.new(mstat, makeCookies(extrameta))
+    end
+    [mstat, extrameta]
+
+  rescue Gorg::Status::NotModified
+    debug("Client cache is up-to-date")
+    raise
+  rescue
+    debug("No manifest for #{objPath} (#{$!})")
+    nil
+  end
+
+
+  def Cache.store(data, objPath, objParam={}, deps=[], extrameta=[], declared=nil)
     # Store data in cache so it can be retrieved based on the objPath and objParams
     # deps should contain a list of files that the object depends on
     # as returnd by our xsl processor, i.e. an array of [access_type, path] where
     # access_type can be "r", "w", or "o" for recpectively read, write, other.
+    # declared is the list of params that the stylesheets declare, if known,
+    # other params are left out of the cache key so that they all hit the same entry
 
     # Define content-type
+    # Work on a copy of extrameta, the caller's array is left alone
     ct = setContentType(data)
-    extrameta << "Content-Type:#{ct}"
+    extrameta = extrameta + ["Content-Type:#{ct}"]
     
     return nil if @cacheDir.nil? # Not initialized, ignore request
     
@@ -178,9 +243,20 @@ module Cache
       return nil
     end
 
+    # Remember which params matter for objPath so that the next hits know
+    if declared then
+      paramsname = makeNames(objPath, nil)[4]
+      FileUtils.mkdir_p(File.dirname(paramsname)) unless @packed or FileTest.directory?(File.dirname(paramsname))
+      writeParams(paramsname, declared) unless readParams(paramsname) == declared
+      objParam = usedParams(objPath, objParam, declared)
+    end
+
     dirname, basename, filename, metaname = makeNames(objPath, objParam)
 
-    FileUtils.mkdir_p(dirname) unless FileTest.directory?(dirname)
+    FileUtils.mkdir_p(dirname) unless @packed or FileTest.directory?(dirname)
+
+    # The new entry is not stale, forget since when the previous one was
+    FileUtils.rm_f(staleName(filename))
     
     # Write Meta file to a temp file (with .timestamp.randomNumber appended)
     metaname_t = "#{metaname}.#{Time.new.strftime('%Y%m%d%H%M%S')}.#{rand(9999)}"
@@ -200,8 +276,11 @@ module Cache
     md5 = Digest::MD5.hexdigest(data)
     
     # Compress data if required
+    # Both lengths go to the meta data so that HEAD requests can be answered from it
+    extrameta << "Content-Length:#{data.bytesize}"
     if @zipLevel > 0 then
       bodyZ = data = gzip(data, @zipLevel)
+      extrameta << "Content-Length-Gzip:#{bodyZ.bytesize}"
     else
       bodyZ = nil
     end
@@ -210,31 +289,21 @@ module Cache
     # so that caching can work better because mtimes will be
     # identical on all webnodes whereas creation date of data
     # would be different on all nodes.
-    maxmtime = Time.now-8e8
-    fstat = nil
+    meta = StringIO.new
+    maxmtime = writeMeta(meta, deps, extrameta)
+    meta = meta.string
+
+    if @packed then
+      # Append meta & data to the packed store, nothing else to do
+      Timeout.timeout(10) {
+        PackedCache.put(filename, meta, data, maxmtime)
+      }
+      return [manifestOf(objPath, objParam, meta), bodyZ]
+    end
     
     begin
-      timeout(10){
-        File.open("#{metaname_t}", "w") {|fmeta|
-          fmeta.puts(CacheStamp)
-          # Write filename;;size;;mtime for each file in deps[]
-          deps.each {|ffe|
-            ftype = ffe[0]
-            fdep = ffe[1]
-            if FileTest.file?(fdep)
-              s = File.stat(fdep)
-              fmeta.puts("#{fdep};;#{s.size};;#{s.mtime.utc};;#{ftype}")
-              maxmtime = s.mtime if s.mtime > maxmtime and ftype =~ /^r$/i
-            else
-              # A required file does not exist, use size=-1 and old timestamp
-              # so that when the file comes back, the cache notices a difference
-              # and no cache miss gets triggered as long as file does not exist
-              fmeta.puts("#{fdep};;-1;;Thu Nov 11 11:11:11 UTC 1971")
-            end
-          }
-          fmeta.puts ";;extra meta"
-          extrameta.each { |m| fmeta.puts m }
-        }
+      Timeout.timeout(10){
+        File.open("#{metaname_t}", "w") {|fmeta| fmeta.write(meta)}
         # Get exclusive access to the cache directory while moving files and/or creating data files
         File.open(dirname) { |lockd|
           while not lockd.flock(File::LOCK_NB|File::LOCK_EX)
@@ -265,7 +334,6 @@ module Cache
           # e.g. when a dependency had changed but result files is identical
           # This is needed to keep Last-Modified dates consistent across web nodes
           File.utime(Time.now, maxmtime, filename)
-          fstat = File.stat(filename)
         }
       }
     ensure
@@ -275,13 +343,13 @@ module Cache
     # Do we clean the cache?
     washCache(dirname, 10) if @washNumber > 0 and rand(@washNumber) < 10
     
-    # Return stat(datafile) even if it's just been removed by washCache
+    # Return the manifest (for etag...) even if the data has just been removed by washCache
     # because another web node might still have it or will have it.
     # Anyway, the cached item would be regenerated on a later request
     # and a 304 would be returned if still appropriate at the time.
 
-    # Return fstat of data file (for etag...) and zipped file
-    [fstat, bodyZ]
+    # Return manifest of data file and zipped file
+    [manifestOf(objPath, objParam, meta), bodyZ]
     
   rescue Timeout::Error, StandardError =>ex
     if ex.class.to_s =~ /timeout::error/i then
@@ -290,12 +358,176 @@ module Cache
       warn("Cache store error (#{$!})")
     end
     # Clean up before leaving
-    FileUtils.rm_rf(filename||"")
-    FileUtils.rm_rf(metaname||"")
+    if @packed then
+      (PackedCache.delete(filename) rescue nil) if filename
+    else
+      FileUtils.rm_rf(filename||"")
+      FileUtils.rm_rf(metaname||"")
+    end
     nil # return nil so that caller can act if a failed store really is a problem
   end
     
     
+  def Cache.refresh(objPath, objParam={})
+    # Run the given block in the background to render objPath again,
+    # unless another process or thread is already doing it
+    # The block is expected to call Cache.store
+    return nil if @cacheDir.nil? # Not initialized, ignore request
+
+    # One lock file per entry, whoever creates it does the job
+    key = makeNames(objPath, usedParams(objPath, objParam))[2]
+    lockdir = "#{@cacheDir}/.refresh"
+    lockname = "#{lockdir}/#{Digest::MD5.hexdigest(key)}"
+    FileUtils.mkdir_p(lockdir) unless FileTest.directory?(lockdir)
+    begin
+      File.open(lockname, File::WRONLY|File::CREAT|File::EXCL) { |f| f.puts($$) }
+      locked = true
+    rescue Errno::EEXIST
+      # Already being rendered, unless whoever did it died a while ago
+      return nil unless Time.now - File.mtime(lockname) > 300
+      File.unlink(lockname)
+      retry
+    end
+
+    debug("Refreshing #{objPath} in the background")
+    job = lambda {
+      begin
+        yield
+      rescue StandardError => ex
+        warn("Background refresh of #{objPath} failed (#{ex})")
+      ensure
+        File.unlink(lockname) rescue nil
+      end
+    }
+    begin
+      # Fork & Detach so that the request does not wait for the transform
+      # fork flushes the standard streams, gorg.cgi and gorg.fcgi have closed STDERR
+      STDIN.reopen("/dev/null") if STDIN.closed?
+      [STDOUT, STDERR].each { |io| io.reopen("/dev/null", "w") if io.closed? }
+      pid = fork {
+        # Do not hold the web server's pipes, the response is over when the parent is done with it
+        STDIN.reopen("/dev/null")
+        [STDOUT, STDERR].each { |io| io.reopen("/dev/null", "w") }
+        job.call
+        exit!(0)
+      }
+      Process.detach(pid)
+    rescue NotImplementedError
+      Thread.new { job.call }
+    end
+    pid
+  rescue StandardError => ex
+    warn("Cannot refresh #{objPath} (#{ex})")
+    # Nobody is going to render it, let the next request try again
+    if locked and pid.nil? then
+      File.unlink(lockname) rescue nil
+    end
+    nil
+  end
+
+
+  def Cache.stages?
+    # Are intermediate results of multi-stage transforms cached
+    @stages && !@cacheDir.nil?
+  end
+
+
+  def Cache.stageIndex(source, style)
+    # Name the application of a stylesheet to a source, regardless of parameters
+    # source is the path of the xml file for the 1st stage and
+    # the key of the previous stage for the next ones
+    Digest::MD5.hexdigest("#{source}\0#{style}")
+  end
+
+
+  def Cache.stageKey(index, params, names)
+    # Name the result of a stage, i.e. its index plus the values of
+    # the params the stylesheet declares, the other ones cannot change its output
+    used = (params||{}).reject{|k,v| k.nil? || !names.include?(k.to_s)}.sort.join("\0")
+    Digest::MD5.hexdigest("#{index}\0#{used}")
+  end
+
+
+  def Cache.stageParams(index)
+    # Return the names of the params declared by the stylesheet of a stage
+    # or nil if that stage has never been cached
+    readParams("#{@stageDir}/#{index}.Params")
+  end
+
+
+  def Cache.stageHit(key)
+    # Return [intermediate result, list of files it depends on, xsl:messages]
+    # or nil if the stage is not cached or if anything it depends on has changed
+    # Dependencies are cumulative, i.e. they include those of the previous stages
+    return nil unless stages?
+
+    metaname = "#{@stageDir}/#{key}.Meta"
+    filename = "#{@stageDir}/#{key}.Data"
+    if @packed then
+      entry = PackedCache.get(filename)
+      raise "Not in packed cache" if entry.nil?
+      meta = entry.meta
+    else
+      meta = IO.read(metaname)
+    end
+    deps = meta.split("\n")[1..-1].take_while{|l| l !~ /^;;extra meta$/}.collect{|l| f=l.split(";;"); [f[3]||"r", f[0]]}
+    msgs = checkDeps(meta)
+    data = @packed ? entry.data : IO.read(filename)
+    raise "Empty data file" if data.length < 1
+
+    # Keep it fresh for washDir or the packed store compaction
+    if @packed then
+      entry.touch
+    else
+      t = Time.new
+      File.utime(t, t, filename, metaname) rescue nil
+    end
+
+    [data, deps, msgs]
+  rescue
+    debug("Stage #{key} not in cache (#{$!})")
+    nil
+  end
+
+
+  def Cache.stageStore(index, params, names, data, deps=[], msgs=[])
+    # Store intermediate result of a stage, return its key
+    names ||= []
+    key = stageKey(index, params, names)
+    return key unless stages?
+    # Same as final results, stages that need remote resources cannot be cached
+    return key if data.nil? || (deps && deps.detect{|f| f[0] =~ /^o$/i })
+
+    if @packed then
+      meta = StringIO.new
+      maxmtime = writeMeta(meta, deps||[], msgs||[])
+      Timeout.timeout(10) {
+        writeParams("#{@stageDir}/#{index}.Params", names)
+        PackedCache.put("#{@stageDir}/#{key}.Data", meta.string, data, maxmtime)
+      }
+      return key
+    end
+
+    FileUtils.mkdir_p(@stageDir) unless FileTest.directory?(@stageDir)
+    tmp = ".#{Time.new.strftime('%Y%m%d%H%M%S')}.#{rand(9999)}"
+    Timeout.timeout(10) {
+      # Each file is written to a temp file and renamed, no need to lock anything
+      writeParams("#{@stageDir}/#{index}.Params", names)
+      File.open("#{@stageDir}/#{key}.Data#{tmp}", "w") {|f| f.write(data)}
+      File.rename("#{@stageDir}/#{key}.Data#{tmp}", "#{@stageDir}/#{key}.Data")
+      File.open("#{@stageDir}/#{key}.Meta#{tmp}", "w") {|f| writeMeta(f, deps||[], msgs||[])}
+      File.rename("#{@stageDir}/#{key}.Meta#{tmp}", "#{@stageDir}/#{key}.Meta")
+    }
+
+    washCache(@stageDir, 10) if @washNumber > 0 and rand(@washNumber) < 10
+    key
+  rescue Timeout::Error, StandardError =>ex
+    warn("Stage cache store error (#{ex})")
+    Dir.glob("#{@stageDir}/*#{tmp}").each{|f| FileUtils.rm_rf(f)} if tmp
+    key
+  end
+
+
   def Cache.washCache(dirname, tmout=30, cleanTree=false)
     # Clean cache entries that are either too old compared to TTL (in seconds)
     # or reduce total size to maxSize (in MB)
@@ -305,6 +537,16 @@ module Cache
     # timeout is the maximum time (in seconds) spent in here
 
     return nil if @cacheDir.nil? # Not initialized, ignore request
+
+    if @packed then
+      # No tree to walk, compact old segments instead
+      t0 = Time.new
+      totalSize, entries, segments = PackedCache.wash(cleanTree)
+      infoMsg = "Packed cache in #{@cacheDir} is now #{totalSize/1024/1024} MB in #{entries} entries, #{segments} segments compacted in #{(Time.now-t0).to_i} seconds"
+      info(infoMsg)
+      puts infoMsg if cleanTree
+      return nil
+    end
     
     # Also ignore request if dirname not equal to @cacheDir or under it
     return nil unless dirname[0, @cacheDir.length] == @cacheDir
@@ -332,7 +574,7 @@ module Cache
           info(infoMsg)
           puts infoMsg if cleanTree
 
-          timeout(tmout) {
+          Timeout.timeout(tmout) {
             totalSize, deletedFiles, scannedDirectories = washDir(dirname, cleanTree)
             if totalSize >= 0 then
               # Size == -1 means dir was locked, throwing an exception would have been nice :)
@@ -363,6 +605,170 @@ module Cache
   
   private
 
+  def Cache.staleName(filename)
+    # Entries that have been found stale have a file named after them in {cacheDir}/.stale
+    "#{@cacheDir}/.stale/#{Digest::MD5.hexdigest(filename)}"
+  end
+
+
+  def Cache.staleSince(filename)
+    # Time a change in the files entry filename depends on was first seen,
+    # i.e. the mtime of its .stale file, created now if there is none yet
+    # Dependencies' own mtimes can be anything (rsync -t, tar, clock skew) and are not used
+    name = staleName(filename)
+    File.mtime(name)
+  rescue Errno::ENOENT
+    FileUtils.mkdir_p(File.dirname(name)) unless FileTest.directory?(File.dirname(name))
+    File.open(name, File::WRONLY|File::CREAT|File::EXCL) {} rescue nil
+    Time.now
+  end
+
+
+  def Cache.checkDeps(meta, changed=nil)
+    # meta is the content of a meta file
+    # Raise an exception if any of the files listed in it has changed
+    # or, if changed is an array, add their names to it and carry on.
+    # Files that have appeared or disappeared always raise.
+    # Return extra meta lines
+    meta = meta.split("\n")
+    raise "I did not write that meta file" unless CacheStamp == meta.shift
+    mline = meta.shift
+    while mline and mline !~ /^;;extra meta$/ do
+      f, s, d = mline.split(";;")
+      if s.to_i < 0
+        # File did not exist when cache entry was created
+        raise "Required file #{f} has (re)appeared" if FileTest.file?(f) && FileTest.readable?(f)
+      else
+        # File did exist when cache entry was created, is it still there?
+        raise "Required file #{f} has disappeared" unless FileTest.file?(f) && FileTest.readable?(f)
+      
+        fst = File.stat(f)
+        # Meta files only keep whole seconds, ignore sub-second mtimes
+        mtime = parseTime(d).to_i
+        if fst.size != s.to_i or fst.mtime.to_i != mtime then
+          raise "Size or timestamp of #{f} has changed" if changed.nil?
+          changed << f
+        end
+      end
+      mline = meta.shift
+    end
+    if mline =~ /^;;extra meta$/ then
+      meta.dup
+    else
+      []
+    end
+  end
+
+
+  def Cache.manifestOf(objPath, objParam, meta, fstat=nil)
+    # Build the Manifest of an entry from the content of its meta file
+    # fstat is the stat of the data, if at hand, for entries that do not record their lengths
+    lines = meta.split("\n")
+    maxmtime = Time.now-8e8   # Same as writeMeta when nothing has been read
+    size = sizeZ = nil
+    extra = false
+    lines[1..-1].each { |l|
+      if l =~ /^;;extra meta$/ then
+        extra = true
+      elsif extra then
+        size = $1.to_i if l =~ /^Content-Length:(\d+)$/
+        sizeZ = $1.to_i if l =~ /^Content-Length-Gzip:(\d+)$/
+      else
+        _, s, d, t = l.split(";;")
+        if s.to_i >= 0 and t.to_s =~ /^r$/i then
+          mtime = parseTime(d)
+          maxmtime = mtime if mtime > maxmtime
+        end
+      end
+    }
+    # Any web node that renders the same entry from the same files comes up with the same ETag
+    key = "#{objPath}+#{(objParam||{}).reject{|k,v| k.nil?}.sort.join('+')}"
+    etag = "\"#{Digest::MD5.hexdigest("#{key}\n#{meta}")}\""
+    size ||= fstat.size if fstat and @zipLevel == 0
+    sizeZ ||= fstat.size if fstat and @zipLevel > 0
+    Manifest.new(etag, Time.at(maxmtime.to_i), size, sizeZ)
+  end
+
+
+  def Cache.parseTime(d)
+    # Timestamps in meta files are whatever Time#to_s gave when they were written
+    if $haveparsedate
+      Time.utc(*ParseDate.parsedate(d))
+    else
+      Time.parse(d)
+    end
+  end
+
+
+  def Cache.usedParams(objPath, objParam, names=nil)
+    # Keep only the params that the stylesheets used for objPath declare
+    # as recorded the last time it was stored. Other params cannot change the output.
+    # Keep them all when we do not know yet.
+    return objParam if objParam.nil? || objParam.to_a.length == 0
+    names ||= readParams(makeNames(objPath, nil)[4])
+    return objParam if names.nil?
+    h = {}
+    objParam.each { |k,v| h[k] = v if names.include?(k.to_s) }
+    h
+  end
+
+
+  def Cache.readParams(name)
+    # Return list of param names from a .Params file, nil if there is none
+    if @packed then
+      entry = PackedCache.get(name)
+      names = entry.meta.split("\n") if entry
+    else
+      names = IO.read(name).split("\n")
+    end
+    raise "I did not write that params file" unless CacheStamp == names.shift
+    names
+  rescue
+    nil
+  end
+
+
+  def Cache.writeParams(name, names)
+    # Write list of param names to a .Params file
+    # Use a temp file and rename it so that readers never see half a file
+    return PackedCache.put(name, ([CacheStamp] + names).join("\n"), "", Time.now) if @packed
+    tmp = "#{name}.#{Time.new.strftime('%Y%m%d%H%M%S')}.#{rand(9999)}"
+    File.open(tmp, "w") { |f|
+      f.puts(CacheStamp)
+      names.each { |n| f.puts n }
+    }
+    File.rename(tmp, name)
+  ensure
+    FileUtils.rm_rf(tmp) if tmp
+  end
+
+
+  def Cache.writeMeta(fmeta, deps, extrameta)
+    # Write stamp, dependencies and extra meta lines to an open meta file
+    # Return latest mtime of all files that were read
+    maxmtime = Time.now-8e8
+    fmeta.puts(CacheStamp)
+    # Write filename;;size;;mtime for each file in deps[]
+    deps.each {|ffe|
+      ftype = ffe[0]
+      fdep = ffe[1]
+      if FileTest.file?(fdep)
+        s = File.stat(fdep)
+        fmeta.puts("#{fdep};;#{s.size};;#{s.mtime.utc};;#{ftype}")
+        maxmtime = s.mtime if s.mtime > maxmtime and ftype =~ /^r$/i
+      else
+        # A required file does not exist, use size=-1 and old timestamp
+        # so that when the file comes back, the cache notices a difference
+        # and no cache miss gets triggered as long as file does not exist
+        fmeta.puts("#{fdep};;-1;;Thu Nov 11 11:11:11 UTC 1971;;#{ftype}")
+      end
+    }
+    fmeta.puts ";;extra meta"
+    extrameta.each { |m| fmeta.puts m }
+    maxmtime
+  end
+
+
   def Cache.washDir(dirname, cleanTree)
     # Clean up cache starting from dirname and in subdirectories if cleanTree is true
     # Return [newSize in bytes, # deleted files, # scanned directories]
@@ -381,7 +787,7 @@ module Cache
             ff = File.stat(f)
             if ff.directory? then
               Find.prune unless cleanTree
-            elsif ff.file? and f =~ /Meta|Data/ then
+            elsif ff.file? and f =~ /Meta|Data|Params/ then
               hIno[ff.ino] = ff.nlink if ff.nlink > 1
               # List of files has [name, atime, size, # links, inode]
               lst << [f, ff.atime, ff.size, ff.nlink, ff.ino]
@@ -496,7 +902,8 @@ module Cache
     f = f.gsub(/[^\w\#.+_-]/, "~").squeeze("~.#+")
     
     # Return names for Data and Meta files, and just the filepath (e.g. #proj#en#index.xml)
-    [dir, "#{dir}/#{base}.Data", "#{dir}/#{f}.Data#{@zip}", "#{dir}/#{f}.Meta"]
+    # and the name of the file that lists the params the stylesheets declare
+    [dir, "#{dir}/#{base}.Data", "#{dir}/#{f}.Data#{@zip}", "#{dir}/#{f}.Meta", "#{dir}/#{base}.Params"]
   end
 end
 
@@ -18,15 +18,21 @@
 # #   along with Foobar; if not, write to the Free Software
 ###   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
-require 'cgi'
-
-require 'gorg/cgi'
+# When gorg --daemon is running, let it do the job, it has everything loaded already
+require 'gorg/client'
 
 if ARGV.length == 1  and  ['-F', '--filter'].include?(ARGV[0]) then
   # cgi does not accept any params like gorg, 
   # Only test on -F or --filter being there and nothing else
-  do_Filter unless STDIN.tty?
-else
+  unless STDIN.tty? or Gorg::Client.filter
+    require 'gorg/cgi'
+    do_Filter
+  end
+elsif not Gorg::Client.cgi
+  require 'cgi'
+
+  require 'gorg/cgi'
+
   # Make CGI's env public to get access to REQUEST_URI and DOCUMENT_ROOT
   class CGI
    public :env_table
@@ -21,29 +21,38 @@
 require "gorg/base"
 
 module Gorg
-  def do_Filter(tmout=30, params=nil)
-    # Read STDIN, transform, spit result out
-    timeout(tmout) {
+  def do_Filter(tmout=30, params=nil, input=STDIN, output=STDOUT, errout=STDERR)
+    # Read input (STDIN), transform, spit result out
+    # gorg --daemon hands over what a client sent instead of the standard streams
+    # Return true if the result was output, false if an error was reported instead
+    deadline = Time.now + tmout
+    xml = Timeout.timeout(tmout) {
       # Give it a few seconds to read it all, then timeout
-      xml = STDIN.read
-      err, body, filelist = xproc(xml, params, false, true)
-      if err["xmlErrLevel"] > 0 then
-        STDERR.puts("#{err.collect{|e|e.join(':')}.join("\n")}")
-      elsif (body||"").length < 1 then
-        # Some transforms can yield empty content
-        STDERR.puts("Empty body")
-      else
-        STDOUT.puts(body)
-      end
+      input.read
     }
+    # A ruby timeout cannot interrupt the transform, it stops by itself when the deadline has passed
+    err, body, filelist = xproc(xml, params, false, true, deadline)
+    if err["xmlErrLevel"] > 0 then
+      errout.puts("#{err.collect{|e|e.join(':')}.join("\n")}")
+      false
+    elsif (body||"").length < 1 then
+      # Some transforms can yield empty content
+      errout.puts("Empty body")
+      false
+    else
+      output.puts(body)
+      true
+    end
   rescue Timeout::Error, StandardError =>ex
     # Just spew it out
-    STDERR.puts(ex)
+    errout.puts(ex)
+    false
   end
   
-  def do_CGI(cgi)
+  def do_CGI(cgi, script=$0)
+    # script is the name the cgi was called by, gorg --daemon passes its client's
     header = Hash.new
-    if cgi.path_info.nil? || cgi.env_table["REQUEST_URI"].index("/#{File.basename($0)}/")
+    if cgi.path_info.nil? || cgi.env_table["REQUEST_URI"].index("/#{File.basename(script)}/")
       # Sorry, I'm not supposed to be called directly, e.g. /cgi-bin/gorg.cgi/bullshit_from_smartass_skriptbaby
       raise Gorg::Status::Forbidden
     elsif cgi.request_method == "OPTIONS"
@@ -106,7 +115,11 @@ module Gorg
           # Get cookies and add them to the parameters
           if $Config["acceptCookies"] then
             # Add cookies to our params
-            query.merge!(cookies_to_params(cgi.cookies))
+            cookieParams = cookies_to_params(cgi.cookies)
+            query.merge!(cookieParams)
+            # Shared caches must not serve pages that depend on cookies to anybody
+            # Cookies the stylesheets do not declare are not part of the cache key, they do not count
+            vary = "Cookie" if cookieParams.length > 0 and Cache.usedParams(path_info, cookieParams).to_a.length > 0
           end
 
           if $Config["httphost"] then
@@ -128,11 +141,33 @@ module Gorg
           end
 
           bodyZ = nil # Compressed version
-          body, mstat, extrameta = Cache.hit(path_info, query, inm, ims)
-          if body.nil? then
+          if cgi.request_method == "HEAD" or inm or ims then
+            # Headers and 304's only need the dependencies recorded in the cache, do not read or render the page
+            mstat, extrameta = Cache.manifest(path_info, query, inm, ims)
+            head = mstat if cgi.request_method == "HEAD" and mstat and mstat.size
+          end
+          body, mstat, extrameta, stale = Cache.hit(path_info, query, inm, ims) unless head
+          # Let load tests (gorg-bench) measure the hit ratio
+          header['X-Gorg-Cache'] = (head or body) ? (stale ? "stale" : "hit") : "miss"
+          if head then
+            # Nothing to do, lengths come from the manifest
+          elsif body.nil? then
             # Cache miss, process file and cache result
-            err, body, filelist, extrameta = xproc(xml_file, xml_query, true)
-            if err["xmlErrLevel"] > 0 then
+            t0 = Time.now
+            err, body, filelist, extrameta, declared, trace = xproc(xml_file, xml_query, true)
+            logSlow(path_info, Time.now-t0, trace)
+            if xslStopped?(err) then
+              # Do not keep the visitor waiting, serve whatever we rendered before, however old
+              warn("#{path_info}: #{err["xmlErrMsg"]}")
+              body, mstat, extrameta = Cache.hit(path_info, query, nil, nil, true)
+              raise Gorg::Status::ServiceUnavailable if body.nil?
+              header['Warning'] = '110 - "Response is Stale"'
+              header['X-Gorg-Cache'] = "stale"
+              if $Config["zipLevel"] > 0 then
+                bodyZ = body
+                body = nil
+              end
+            elsif err["xmlErrLevel"] > 0 then
               raise "#{err.collect{|e|e.join(':')}.join('<br/>')}"
             elsif (body||"").length < 1 then
               # Some transforms can yield empty content (handbook?part=9&chap=99)
@@ -140,12 +175,12 @@ module Gorg
               raise Gorg::Status::NotFound
             else
               # Cache the output if all was OK
-              mstat, bodyZ = Cache.store(body, path_info, query, filelist, extrameta)
+              mstat, bodyZ = Cache.store(body, path_info, query, filelist, extrameta, declared)
               debug("Cached #{path_info}, mstat=#{mstat.inspect}")
               # Check inm & ims again as they might match if another web node had
               # previously delivered the same data
-              if notModified?(mstat, inm, ims) and extrameta.join !~ /set-cookie/i
-                raise Gorg::Status::NotModified.new(mstat)
+              if notModified?(mstat, inm, ims)
+                raise Gorg::Status::NotModified.new(mstat, makeCookies(extrameta))
               end
             end
           else
@@ -153,9 +188,24 @@ module Gorg
               bodyZ = body
               body = nil
             end
+            if stale then
+              # Serve it now and render it again for the next visitors
+              header['Warning'] = '110 - "Response is Stale"'
+              revalidate(path_info, xml_file, xml_query, query)
+            end
           end
           # If client accepts gzip encoding and we support it, return gzipped file
-          if bodyZ and $Config["zipLevel"] > 0 and ( cgi.accept_encoding =~ /gzip(\s*;\s*q=([0-9\.]+))?/ and ($2||"1") != "0" ) then
+          gz = $Config["zipLevel"] > 0 && ( cgi.accept_encoding =~ /gzip(\s*;\s*q=([0-9\.]+))?/ and ($2||"1") != "0" )
+          if head then
+            body = ""
+            if gz and head.sizeZ then
+              header['length'] = head.sizeZ
+              header['Content-Encoding'] = "gzip"
+              header['Vary'] = "Accept-Encoding"
+            else
+              header['length'] = head.size
+            end
+          elsif bodyZ and gz then
             body = bodyZ
             header['Content-Encoding'] = "gzip"
             header['Vary'] = "Accept-Encoding"
@@ -165,13 +215,14 @@ module Gorg
               body = gunzip(bodyZ)
             end
           end
+          header['Vary'] = [header['Vary'], vary].compact.join(", ") if vary
           # Add cookies to http header
           cookies = makeCookies(extrameta)
           if cookies then
             header['cookie'] = cookies
           end
-          # Add Content-Type to header
-          ct = contentType(extrameta)
+          # Add Content-Type to header, fresh output has none in extrameta yet
+          ct = contentType(extrameta) || (setContentType(body) if body)
           if ct then
             # Turn application/xhtml+xml into text/html if browser does not accept it
             if cgi.accept !~ /application\/xhtml\+xml/ and ct =~ /application\/xhtml\+xml(.*)$/ then
@@ -190,13 +241,19 @@ module Gorg
           header['Last-Modified'] = mstat.mtime.httpdate
         end
       end
-      cgi.out(header){body} 
+      if header['length'] then
+        # HEAD answered from the manifest, cgi.out would count the bytes of the empty body
+        cgi.print(cgi.http_header(header))
+      else
+        cgi.out(header){body} 
+      end
     else # Not a HEAD or GET
       raise Gorg::Status::NotAllowed
     end
   rescue => ex
     if ex.respond_to?(:errCode) then
       # One of ours (Gorg::Status::HTTPStatus)
+      ex.vary = vary if vary and ex.respond_to?(:vary=)
       cgi.out(ex.header){ex.html}
     else
       # Some ruby exceptions occurred, make it a 500
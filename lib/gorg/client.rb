@@ -0,0 +1,195 @@
+###   Copyright 2004,   Xavier Neys   (neysx@gentoo.org)
+# #
+# #   This file is part of gorg.
+# #
+# #   gorg is free software; you can redistribute it and/or modify
+# #   it under the terms of the GNU General Public License as published by
+# #   the Free Software Foundation; either version 2 of the License, or
+# #   (at your option) any later version.
+# #
+# #   gorg is distributed in the hope that it will be useful,
+# #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+# #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# #   GNU General Public License for more details.
+# #
+# #   You should have received a copy of the GNU General Public License
+# #   along with gorg; if not, write to the Free Software
+###   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+# Thin client of gorg --daemon, used by gorg.cgi and the filter
+#
+# It only needs the socket, i.e. it does not load the xsl extension nor parse the config file,
+# which is what makes it worth it. Requests and responses are framed on the socket:
+#
+# Request : "GORG1", then strings mode, script, cwd, then hashes env & params, then string input
+#           A string is its length (32 bits, network order) followed by its bytes,
+#           a hash is its number of pairs followed by name & value strings
+# Response: any number of frames, a type byte, a length and that many bytes
+#           o = stdout, e = stderr, x = end of response (exit status, in digits)
+
+require "socket"
+require "stringio"
+
+module Gorg
+
+module Client
+  Magic   = "GORG1"
+  MaxLen  = 256*1024*1024   # Nothing we send is anywhere near that long
+
+  def Client.socket
+    # Path of the daemon's socket from GORG_SOCKET or the config file, nil if none
+    return ENV["GORG_SOCKET"] if ENV["GORG_SOCKET"]
+    conf = ENV["GORG_CONF"]||ENV["REDIRECT_GORG_CONF"]||"/etc/gorg/gorg.conf"
+    IO.foreach(conf) { |l| return $1 if l =~ /^\s*daemonSocket\s*=\s*"?([^"#\s]+)/i }
+    nil
+  rescue SystemCallError
+    nil
+  end
+
+
+  def Client.cgi(path=socket)
+    # Forward the cgi request in our environment to the daemon and copy its response to stdout
+    # Return the daemon's exit status, or false if the daemon cannot be reached,
+    # the caller should then do the job itself
+    request(path, "cgi", ENV.to_h, {}) { "" }
+  end
+
+
+  def Client.filter(params={}, path=socket)
+    # Forward stdin to the daemon to be transformed, copy its output to stdout & stderr
+    # Return the daemon's exit status, or false if the daemon cannot be reached, stdin has not been read then
+    request(path, "filter", {}, params||{}) { STDIN.read }
+  end
+
+
+  def Client.request(path, mode, env, params)
+    # Send request once connected, input is what the block returns
+    # Raise if the response stops before its end frame, part of it might have been copied already
+    return false if path.nil?
+    begin
+      sock = UNIXSocket.new(path)
+    rescue SystemCallError
+      return false
+    end
+    input = yield
+    sock.write(Magic)
+    [mode, $0, Dir.pwd].each { |s| putString(sock, s) }
+    putHash(sock, env)
+    putHash(sock, params)
+    putString(sock, input)
+    sock.close_write
+    STDOUT.binmode
+    # Copy the response as it comes
+    status = nil
+    while hdr = sock.read(5) and hdr.length == 5
+      type, len = hdr.unpack("aN")
+      data = len > 0 ? sock.read(len) : ""
+      break if data.nil? or data.length < len
+      case type
+        when "o"
+          STDOUT.write(data)
+        when "e"
+          STDERR.write(data)
+        when "x"
+          status = data.to_i
+          break
+      end
+    end
+    STDOUT.flush
+    raise "Truncated response from gorg daemon on #{path}" if status.nil?
+    status
+  ensure
+    sock.close if sock and not sock.closed?
+  end
+
+
+  def Client.readRequest(sock)
+    # Daemon side, return [mode, script, cwd, env, params, input]
+    raise "Not a gorg client" unless sock.read(Magic.length) == Magic
+    [getString(sock), getString(sock), getString(sock), getHash(sock), getHash(sock), getString(sock)]
+  end
+
+
+  def Client.putString(io, s)
+    s = s.to_s.b
+    io.write([s.length].pack("N"), s)
+  end
+
+  def Client.getString(io)
+    len = (io.read(4)||"").unpack("N")[0]
+    raise "Truncated request" if len.nil? or len > MaxLen
+    s = len > 0 ? io.read(len) : ""
+    raise "Truncated request" if s.nil? or s.length < len
+    s.force_encoding(Encoding.default_external)
+  end
+
+  def Client.putHash(io, h)
+    io.write([h.length].pack("N"))
+    h.each { |k, v| putString(io, k); putString(io, v) }
+  end
+
+  def Client.getHash(io)
+    n = (io.read(4)||"").unpack("N")[0]
+    raise "Truncated request" if n.nil? or n > 65536
+    h = {}
+    n.times { k = getString(io); h[k] = getString(io) }
+    h
+  end
+
+
+  class FrameWriter
+    # Daemon side, quacks like STDOUT or STDERR but sends what it is given
+    # to the client in frames of the given type
+    def initialize(sock, type)
+      @sock, @type = sock, type
+    end
+
+    def write(*a)
+      s = a.join.b
+      @sock.write([@type, s.length].pack("aN"), s) if s.length > 0
+      s.length
+    end
+
+    def print(*a)
+      write(*a)
+      nil
+    end
+
+    def puts(*a)
+      io = StringIO.new
+      io.puts(*a)
+      write(io.string)
+      nil
+    end
+
+    def <<(s)
+      write(s)
+      self
+    end
+
+    def flush
+      self
+    end
+
+    def binmode
+      self
+    end
+
+    def sync
+      true
+    end
+
+    def sync=(v)
+      v
+    end
+
+    def close(status=0)
+      # End of response
+      s = status.to_s
+      @sock.write(["x", s.length].pack("aN"), s)
+    end
+  end
+end
+
+end
@@ -0,0 +1,163 @@
+###   Copyright 2004,   Xavier Neys   (neysx@gentoo.org)
+# #
+# #   This file is part of gorg.
+# #
+# #   gorg is free software; you can redistribute it and/or modify
+# #   it under the terms of the GNU General Public License as published by
+# #   the Free Software Foundation; either version 2 of the License, or
+# #   (at your option) any later version.
+# #
+# #   gorg is distributed in the hope that it will be useful,
+# #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+# #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# #   GNU General Public License for more details.
+# #
+# #   You should have received a copy of the GNU General Public License
+# #   along with gorg; if not, write to the Free Software
+###   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+# Run gorg --daemon: a few preforked processes that have loaded gorg once and for all
+# serve the requests that gorg.cgi and gorg -F forward to them on a unix socket.
+# See gorg/client.rb for the other end.
+
+require "gorg/cgi"
+require "gorg/client"
+require "socket"
+require "etc"
+require "timeout"
+
+module Gorg
+
+# CGI object built from the environment and input that a client forwarded
+class DaemonCGI < CGI
+  public :env_table
+
+  def initialize(env, input, output)
+    @daemonEnv, @daemonInput, @daemonOutput = env, input, output
+    super()
+  end
+
+  def env_table
+    @daemonEnv
+  end
+
+  def stdinput
+    @daemonInput
+  end
+
+  def stdoutput
+    @daemonOutput
+  end
+end
+
+
+module Daemon
+  def Daemon.run
+    path = $Config["daemonSocket"]
+    raise "No daemonSocket defined" unless path
+    if File.socket?(path) then
+      # Left over by a daemon that died, unless it is still there
+      begin
+        UNIXSocket.new(path).close
+        raise "Another gorg daemon is listening on #{path}"
+      rescue Errno::ECONNREFUSED
+        File.unlink(path)
+      end
+    end
+    # Whoever can connect can have us read & render files with our privileges
+    # Nobody else may connect before the socket has got its mode & group
+    umask = File.umask(0177)
+    begin
+      server = UNIXServer.new(path)
+    ensure
+      File.umask(umask)
+    end
+    if group = $Config["daemonSocketGroup"] then
+      File.chown(nil, group =~ /^\d+$/ ? group.to_i : Etc.getgrnam(group).gid, path)
+    end
+    File.chmod($Config["daemonSocketMode"], path)
+    @root = $Config["root"]
+    workers = {}
+    stop = false
+
+    # Prefork workers and start new ones as they die
+    %w(INT TERM).each { |sig|
+      trap(sig) {
+        stop = true
+        workers.each_key { |pid| Process.kill("TERM", pid) rescue nil }
+      }
+    }
+    info("Gorg daemon listening on #{path} with #{$Config['daemonWorkers']} workers")
+    puts "\n\nStarting the Gorg daemon on #{path}\n\nHit Ctrl-C or type \"kill #{$$}\" to stop it\n\n"
+    until stop
+      while workers.length < $Config["daemonWorkers"] and not stop
+        pid = fork {
+          %w(INT TERM).each { |sig| trap(sig, "DEFAULT") }
+          worker(server)
+          exit!(0)
+        }
+        workers[pid] = true
+      end
+      begin
+        workers.delete(Process.wait)
+      rescue Errno::ECHILD, Errno::EINTR
+        nil
+      end
+    end
+    workers.each_key { |pid| Process.wait(pid) rescue nil }
+  ensure
+    server.close if server
+    File.unlink(path) if server and File.socket?(path)
+  end
+
+
+  def Daemon.worker(server)
+    # Serve requests one at a time until we have grown too fat, like gorg.fcgi does
+    countReq = 0
+    loop do
+      sock = server.accept
+      serve(sock)
+      countReq += 1
+      if mem = memoryExceeded then
+        info("Daemon worker #{$$} exits: #{mem} after #{countReq} requests")
+        break
+      end
+      GC.start if countReq%50==0
+    end
+  end
+
+
+  def Daemon.serve(sock)
+    mode, script, cwd, env, params, input = Timeout.timeout(10) {
+      # Do not let a client that has nothing to say hold a worker
+      Client.readRequest(sock)
+    }
+    out = Client::FrameWriter.new(sock, "o")
+    err = Client::FrameWriter.new(sock, "e")
+    # Requests must not see what a previous one did to the config
+    $Config["root"] = @root
+    status = 0
+    case mode
+      when "cgi"
+        do_CGI(DaemonCGI.new(env, StringIO.new(input), out), script)
+      when "filter"
+        # Relative paths in the xml file are from the client's current directory
+        Dir.chdir(cwd) {
+          status = 1 unless do_Filter(300, params, StringIO.new(input), out, err)
+        }
+      else
+        err.puts("Unknown request #{mode}")
+        status = 1
+    end
+    out.close(status)
+  rescue Timeout::Error, StandardError => ex
+    warn("Daemon request failed: #{ex}")
+    # Let the client know if it is still listening
+    (out.close(1) rescue nil) if out
+  ensure
+    sock.close rescue nil
+  end
+end
+
+end
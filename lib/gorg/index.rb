@@ -0,0 +1,338 @@
+###   Copyright 2004,   Xavier Neys   (neysx@gentoo.org)
+# #
+# #   This file is part of gorg.
+# #
+# #   gorg is free software; you can redistribute it and/or modify
+# #   it under the terms of the GNU General Public License as published by
+# #   the Free Software Foundation; either version 2 of the License, or
+# #   (at your option) any later version.
+# #
+# #   gorg is distributed in the hope that it will be useful,
+# #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+# #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# #   GNU General Public License for more details.
+# #
+# #   You should have received a copy of the GNU General Public License
+# #   along with gorg; if not, write to the Free Software
+###   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+# Build a search index of the site, used by gorg --index
+#
+# Files under {root} are selected with the include/exclude directives,
+# their language comes from xpath_to_lang or, failing that, fpath_to_lang
+# Only files whose mtime has changed since the last run are processed again,
+# by several processes in parallel.
+#
+# The index is kept in
+#   . a file (indexFile) that holds the list of documents and, for each term,
+#     its postings (document id, number of occurrences) delta-encoded and packed
+#     as BER compressed integers
+#   . or an SQLite database when dbConnect = sqlite:/path/to/file.db
+
+require "gorg/base"
+require "find"
+require "fileutils"
+
+module Gorg
+
+module Index
+  MinTerm = 2       # Shorter words are not indexed
+  MaxTerm = 40      # Neither are longer ones
+
+  def Index.run(jobs=1)
+    # (Re-)index the site, return [number of files indexed, number of files removed from the index]
+    root = ($Config["root"]||"").chomp("/")
+    raise "No root directory to index" unless FileTest.directory?(root)
+    store = openStore
+    t0 = Time.now
+
+    # Which files need indexing
+    known = store.docs   # {path => [id, mtime]}
+    todo = []; seen = {}
+    Find.find(root) { |f|
+      next unless FileTest.file?(f)
+      path = f[root.length..-1]
+      next unless indexed?(path)
+      seen[path] = true
+      mtime = File.mtime(f).to_i
+      todo << [path, mtime] unless known[path] && known[path][1] == mtime
+    }
+    gone = known.keys.reject { |path| seen[path] }
+    info("Indexing #{todo.length} files with #{jobs} jobs, #{gone.length} files to remove from the index")
+
+    # Forget what we knew about files that have changed or disappeared
+    store.remove((gone + todo.collect{|t| t[0]}).collect{|path| known[path] && known[path][0]}.compact)
+
+    # Documents come back from the workers in any order
+    n = 0
+    parallel(todo, jobs, root) { |path, mtime, lang, title, terms|
+      store.add(path, mtime, lang, title, terms)
+      n += 1 if lang
+    }
+    store.close
+    info("#{n} files indexed in #{(Time.now-t0).to_i} seconds")
+    [n, gone.length]
+  end
+
+
+  def Index.search(words, lang=nil, max=50)
+    # Return [[path, title, score],...] of the documents that contain all the words
+    terms = tokenize(words).keys
+    return [] if terms.length == 0
+    store = openStore
+    store.search(terms, lang, max)
+  ensure
+    store.close(false) if store
+  end
+
+
+  def Index.indexed?(path)
+    # First matching include/exclude directive wins, files that match none are skipped
+    $Config["in/out"].each { |inc, re| return inc if re.match(path) }
+    false
+  end
+
+
+  def Index.tokenize(text)
+    # Return {term => number of occurrences}
+    terms = Hash.new(0)
+    text.downcase.scan(/[[:alnum:]][[:alnum:]_'-]*/) { |w|
+      w = w.sub(/['-]+$/, "")
+      terms[w] += 1 if w.length >= MinTerm and w.length <= MaxTerm
+    }
+    terms
+  end
+
+
+  private
+
+  def Index.openStore
+    if ($Config["dbConnect"]||"") =~ /^sqlite:(.+)$/ then
+      SqliteStore.new($1)
+    else
+      raise "No indexFile defined" unless $Config["indexFile"]
+      FileStore.new($Config["indexFile"])
+    end
+  end
+
+
+  def Index.parallel(todo, jobs, root)
+    # Fork jobs workers, each one processes every jobs-th file and sends its results
+    # back to us through a pipe as [path, mtime, lang, title, terms]
+    # Files that cannot be processed come back without lang, title or terms
+    # so that they are not tried again until they change
+    return if todo.length == 0
+    jobs = [[jobs, 1].max, todo.length].min
+    workers = (0...jobs).collect { |j|
+      rd, wr = IO.pipe
+      pid = fork {
+        rd.close
+        j.step(todo.length-1, jobs) { |i|
+          path, mtime = todo[i]
+          doc = extract("#{root}#{path}", path) || [nil, nil, {}]
+          Marshal.dump([path, mtime] + doc, wr)
+        }
+        wr.close
+        exit!(0)
+      }
+      wr.close
+      [pid, rd]
+    }
+    # Read from whichever worker has something to say
+    pipes = workers.collect { |w| w[1] }
+    while pipes.length > 0
+      IO.select(pipes)[0].each { |rd|
+        begin
+          yield Marshal.load(rd)
+        rescue EOFError, ArgumentError
+          pipes.delete(rd)
+          rd.close
+        end
+      }
+    end
+  ensure
+    (workers||[]).each { |pid, rd| Process.wait(pid) rescue nil }
+  end
+
+
+  def Index.extract(file, path)
+    # Return [lang, title, terms] or nil if file cannot be processed
+    xsltproc = Gorg::XSL.new
+    xsltproc.xroot = $Config["root"]
+    xsltproc.xml = file
+    xsltproc.xsl = textXSL
+    xsltproc.process
+    return nil if xsltproc.xerr["xmlErrLevel"] > 1
+    # Our stylesheet outputs UTF-8, the string we get has no encoding
+    lang, title, text = (xsltproc.xres||"").dup.force_encoding("UTF-8").scrub.split("\n", 3)
+    lang = lang.to_s.strip
+    if lang.length == 0 and $Config["flang"] and $Config["flang"].match(path) then
+      # Fall back on the file path
+      lang = $1.to_s
+    end
+    [lang[0,5], title.to_s.strip, tokenize(text.to_s)]
+  rescue StandardError => ex
+    debug("Cannot index #{file} (#{ex})")
+    nil
+  end
+
+
+  def Index.textXSL
+    # Stylesheet that returns the language, the title and the text of a document, one per line
+    # Language comes from xpath_to_lang, title from the first title element
+    xlang = $Config["xlang"] || "''"
+    @textXSL ||= <<-EOXSL
+<?xml version="1.0" encoding="UTF-8"?>
+<xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+<xsl:output method="text" encoding="UTF-8"/>
+<xsl:template match="/">
+  <xsl:value-of select="normalize-space(string(#{xlang.gsub('&', '&amp;').gsub('<', '&lt;').gsub('"', '&quot;')}))"/>
+  <xsl:text>&#10;</xsl:text>
+  <xsl:value-of select="normalize-space((//title)[1])"/>
+  <xsl:text>&#10;</xsl:text>
+  <xsl:for-each select="//text()"><xsl:value-of select="."/><xsl:text> </xsl:text></xsl:for-each>
+</xsl:template>
+</xsl:stylesheet>
+    EOXSL
+  end
+
+
+  class FileStore
+    # The whole index is loaded in memory, updated and written back to a temp file
+    # that replaces the old one, i.e. searches never see half an index
+    Magic = "GORGIX01"
+
+    def initialize(name)
+      @name = name
+      @docs = {}      # id => [path, mtime, lang, title]
+      @terms = {}     # term => postings, i.e. packed [delta id, freq, delta id, freq...]
+      @nextId = 1
+      if FileTest.file?(name) then
+        File.open(name, "rb") { |f|
+          raise "#{name} is not a gorg index" unless f.read(Magic.length) == Magic
+          @docs, @terms, @nextId = Marshal.load(f)
+        }
+      end
+      @added = Hash.new { |h,k| h[k] = [] }
+    end
+
+    def docs
+      h = {}
+      @docs.each { |id, d| h[d[0]] = [id, d[1]] }
+      h
+    end
+
+    def remove(ids)
+      return if ids.length == 0
+      dead = {}
+      ids.each { |id| @docs.delete(id); dead[id] = true }
+      @terms.keys.each { |term|
+        p = Index.unpack(@terms[term]).reject { |id, freq| dead[id] }
+        if p.length > 0 then
+          @terms[term] = Index.pack(p)
+        else
+          @terms.delete(term)
+        end
+      }
+    end
+
+    def add(path, mtime, lang, title, terms)
+      id = @nextId; @nextId += 1
+      @docs[id] = [path, mtime, lang, title]
+      terms.each { |term, freq| @added[term] << [id, freq] }
+    end
+
+    def close(write=true)
+      return unless write
+      # New ids are higher than any existing one, postings stay sorted
+      @added.each { |term, p| @terms[term] = Index.pack((@terms[term] ? Index.unpack(@terms[term]) : []) + p) }
+      tmp = "#{@name}.#{$$}"
+      FileUtils.mkdir_p(File.dirname(@name))
+      File.open(tmp, "wb") { |f|
+        f.write(Magic)
+        Marshal.dump([@docs, @terms, @nextId], f)
+      }
+      File.rename(tmp, @name)
+    end
+
+    def search(terms, lang, max)
+      hits = nil
+      terms.each { |term|
+        p = @terms[term] or return []
+        h = {}
+        Index.unpack(p).each { |id, freq| h[id] = freq if hits.nil? or hits[id] }
+        h.each_key { |id| h[id] += hits[id] } if hits
+        hits = h
+      }
+      hits = hits.select { |id, score| @docs[id][2] == lang } if lang
+      hits.sort_by { |id, score| -score }[0, max].collect { |id, score| [@docs[id][0], @docs[id][3], score] }
+    end
+  end
+
+
+  class SqliteStore
+    # Same thing in an SQLite database, one row per posting
+    def initialize(name)
+      require "sqlite3"
+      @db = SQLite3::Database.new(name)
+      @db.execute_batch(<<-EOSQL)
+        CREATE TABLE IF NOT EXISTS docs (id INTEGER PRIMARY KEY, path TEXT UNIQUE, mtime INTEGER, lang TEXT, title TEXT);
+        CREATE TABLE IF NOT EXISTS postings (term TEXT, doc INTEGER, freq INTEGER);
+        CREATE INDEX IF NOT EXISTS postings_term ON postings (term);
+        CREATE INDEX IF NOT EXISTS postings_doc ON postings (doc);
+      EOSQL
+      @db.transaction
+    end
+
+    def docs
+      h = {}
+      @db.execute("SELECT id, path, mtime FROM docs") { |id, path, mtime| h[path] = [id, mtime] }
+      h
+    end
+
+    def remove(ids)
+      ids.each { |id|
+        @db.execute("DELETE FROM postings WHERE doc = ?", [id])
+        @db.execute("DELETE FROM docs WHERE id = ?", [id])
+      }
+    end
+
+    def add(path, mtime, lang, title, terms)
+      @db.execute("INSERT INTO docs (path, mtime, lang, title) VALUES (?, ?, ?, ?)", [path, mtime, lang, title])
+      id = @db.last_insert_row_id
+      terms.each { |term, freq| @db.execute("INSERT INTO postings (term, doc, freq) VALUES (?, ?, ?)", [term, id, freq]) }
+    end
+
+    def close(write=true)
+      if write then
+        @db.commit
+      else
+        @db.rollback
+      end
+      @db.close
+    end
+
+    def search(terms, lang, max)
+      sql = "SELECT d.path, d.title, SUM(p.freq) FROM postings p JOIN docs d ON d.id = p.doc " +
+            "WHERE p.term IN (#{(['?']*terms.length).join(',')})"
+      sql << " AND d.lang = ?" if lang
+      sql << " GROUP BY d.id HAVING COUNT(*) = ? ORDER BY 3 DESC LIMIT ?"
+      @db.execute(sql, terms + (lang ? [lang] : []) + [terms.length, max])
+    end
+  end
+
+
+  def Index.pack(postings)
+    # [[id, freq],...] sorted on id => string of delta-encoded BER integers
+    last = 0
+    postings.collect { |id, freq| d = id - last; last = id; [d, freq] }.flatten.pack("w*")
+  end
+
+  def Index.unpack(packed)
+    last = 0
+    packed.unpack("w*").each_slice(2).collect { |d, freq| last += d; [last, freq] }
+  end
+end
+
+end
@@ -0,0 +1,376 @@
+###   Copyright 2004,   Xavier Neys   (neysx@gentoo.org)
+# #
+# #   This file is part of gorg.
+# #
+# #   gorg is free software; you can redistribute it and/or modify
+# #   it under the terms of the GNU General Public License as published by
+# #   the Free Software Foundation; either version 2 of the License, or
+# #   (at your option) any later version.
+# #
+# #   gorg is distributed in the hope that it will be useful,
+# #   but WITHOUT ANY WARRANTY; without even the implied warranty of
+# #   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# #   GNU General Public License for more details.
+# #
+# #   You should have received a copy of the GNU General Public License
+# #   along with gorg; if not, write to the Free Software
+###   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+# Packed cache store, used by Gorg::Cache when cacheStore = packed
+#
+# Entries (meta + data) are appended to a few large segment files
+#   {cacheDir}/packed/seg.000001, seg.000002, ...
+# and found through a fixed-size hash table in
+#   {cacheDir}/packed/index
+# that is read and updated in place, one slot at a time.
+#
+# Nothing ever walks the cache: space is reclaimed by compacting the oldest
+# segment, i.e. entries that have been used since they were written into it
+# are copied to the newest segment, the others are dropped, then the segment is removed.
+
+require "fileutils"
+require "digest/md5"
+require "thread"
+
+module Gorg
+
+module PackedCache
+  Magic     = "GORGPK01"
+  RecMagic  = "GREC"
+  HeaderLen = 64                # magic, number of slots, total bytes in segments, number of entries
+  HeaderFmt = "a8LQQ"
+  SlotLen   = 48                # hash, segment, offset, meta length, data length, mtime, atime, ctime, referenced
+  SlotFmt   = "QLQLLLLLQ"
+  RecLen    = 16                # magic, key length, meta length, data length
+  RecFmt    = "a4LLL"
+  Empty     = 0                 # Hash values of free and deleted slots
+  Deleted   = 1
+  TOTAL     = 2                 # Header fields
+  COUNT     = 3
+
+  # Returned by hit in place of a File::Stat of a data file, makeETag() is happy with it
+  EntryStat = Struct.new(:size, :mtime, :ino)
+
+  class Entry
+    attr_reader :key, :meta, :stat
+    def initialize(key, meta, stat, seg, off, slot)
+      @key, @meta, @stat, @seg, @off, @slot = key, meta, stat, seg, off, slot
+    end
+    def data
+      # nil if the entry has been replaced, compacted or deleted since it was found
+      d = PackedCache.readEntry(@key, @slot, @seg, @off, @key.bytesize + @meta.bytesize, @stat.size)
+      d.force_encoding(Encoding.default_external) if d
+    end
+    def touch
+      PackedCache.touch(@slot)
+    end
+  end
+
+  def PackedCache.init(dir, maxSize, ttl, nSlots)
+    @dir = "#{dir}/packed"
+    @maxSize = maxSize
+    @ttl = ttl
+    @segSize = [maxSize/8, 1024*1024].max    # Roll over to a new segment after so many bytes
+    @segs = {}                              # Segment files opened for reading
+    @mutex = Mutex.new                      # flock does not protect threads (WEBrick) from each other
+    FileUtils.mkdir_p(@dir) unless FileTest.directory?(@dir)
+    @index = File.open("#{@dir}/index", File::RDWR|File::CREAT, 0644)
+    @pid = Process.pid
+    locked(File::LOCK_EX) {
+      if @index.size < HeaderLen then
+        # Brand new index, slots are all zeros, i.e. free
+        @index.pwrite([Magic, nSlots, 0, 0].pack(HeaderFmt).ljust(HeaderLen, "\0"), 0)
+        @index.truncate(HeaderLen + nSlots*SlotLen)
+      end
+    }
+    raise "#{@dir}/index is not a gorg index" unless header[0] == Magic
+    @nSlots = header[1]
+  end
+
+
+  def PackedCache.get(key)
+    # Return Entry for key or nil
+    key = key.b
+    h = hashKey(key)
+    locked(File::LOCK_SH) {
+      i, slot = findSlot(key, h)
+      if slot then
+        mlen = slot[3]
+        meta = readData(slot[1], slot[2], key.length, mlen).force_encoding(Encoding.default_external)
+        Entry.new(key, meta, EntryStat.new(slot[4], Time.at(slot[5]), h & 0xffffffff), slot[1], slot[2], i)
+      end
+    }
+  rescue Errno::ENOENT
+    # Segment has just been compacted away
+    nil
+  end
+
+
+  def PackedCache.put(key, meta, data, mtime)
+    # Append entry to the current segment and point its slot at it
+    # Return an EntryStat for the new data
+    key, meta, data = key.b, meta.b, data.b
+    h = hashKey(key)
+    t = Time.now.to_i
+    stat = nil
+    locked(File::LOCK_EX) {
+      seg, off = append(key, meta, data)
+      i, slot = findSlot(key, h)
+      i ||= freeSlot(h)
+      raise "Packed cache index is full" if i.nil?
+      total, count = header[TOTAL], header[COUNT]
+      total += RecLen + key.length + meta.length + data.length
+      count += 1 unless slot
+      writeSlot(i, [h, seg, off, meta.length, data.length, mtime.to_i, t, t, 0])
+      writeHeader(total, count)
+      stat = EntryStat.new(data.length, Time.at(mtime.to_i), h & 0xffffffff)
+      # Reclaim space a bit at a time, one segment per store at most
+      compact(1) if total > @maxSize or count > @nSlots*8/10
+    }
+    stat
+  end
+
+
+  def PackedCache.delete(key)
+    key = key.b
+    h = hashKey(key)
+    locked(File::LOCK_EX) {
+      i, slot = findSlot(key, h)
+      if slot then
+        writeSlot(i, [Deleted, 0, 0, 0, 0, 0, 0, 0, 0])
+        writeHeader(header[TOTAL], header[COUNT]-1)
+      end
+    }
+  end
+
+
+  def PackedCache.wash(all=false)
+    # Compact old segments until the store fits in maxSize
+    # or compact all of them if requested
+    # Return [size in bytes, number of entries, number of compacted segments]
+    n = 0
+    locked(File::LOCK_EX) {
+      if all then
+        rollOver
+        n = compact(segments.length-1, false)
+      else
+        n = compact(segments.length, true)
+      end
+    }
+    [header[TOTAL], header[COUNT], n]
+  end
+
+
+  def PackedCache.touch(i)
+    # Set atime and referenced flag of entry in slot i, racy writes are harmless
+    # The flag gives the entry a second chance when its segment is compacted
+    forked?
+    @index.pwrite([Time.now.to_i].pack("L"), HeaderLen + i*SlotLen + 32)
+    @index.pwrite([1].pack("Q"), HeaderLen + i*SlotLen + 40)
+  rescue
+    nil
+  end
+
+
+  def PackedCache.readEntry(key, i, seg, off, skip, len)
+    # Read the data of the entry found in slot i at offset off in segment seg
+    # The shared lock keeps compaction from removing the segment while it is read
+    # Return nil if slot i does not point there anymore
+    locked(File::LOCK_SH) {
+      slot = readSlot(i)
+      readData(seg, off, skip, len) if slot[0] == hashKey(key) and slot[1] == seg and slot[2] == off
+    }
+  rescue Errno::ENOENT
+    nil
+  end
+
+
+  def PackedCache.readData(seg, off, skip, len)
+    # Read len bytes of the record at offset off in segment seg, after its header and skip bytes
+    return "" if len == 0
+    forked?
+    segFile(seg).pread(len, off + RecLen + skip)
+  end
+
+
+  private
+
+  def PackedCache.forked?
+    # flock locks belong to the open file, which processes forked after init share with
+    # their parent (gorg --daemon workers, Cache.refresh), i.e. they would not exclude each other.
+    # Open our own index and segments the first time we are used in a new process
+    return false if @pid == Process.pid
+    @index.close rescue nil
+    @segs.each_value { |f| f.close rescue nil }
+    @index = File.open("#{@dir}/index", File::RDWR|File::CREAT, 0644)
+    @segs = {}
+    @mutex = Mutex.new
+    @pid = Process.pid
+    true
+  end
+
+  def PackedCache.locked(mode)
+    forked?
+    @mutex.synchronize {
+      begin
+        # Same as Cache.store, do not block forever on a lock, timeout might be around us
+        sleep 0.05 until @index.flock(mode|File::LOCK_NB)
+        yield
+      ensure
+        @index.flock(File::LOCK_UN)
+      end
+    }
+  end
+
+  def PackedCache.hashKey(key)
+    # 64 bits of the MD5 of the key, 0 and 1 mean free and deleted slots
+    h = Digest::MD5.digest(key)[0,8].unpack("Q")[0]
+    h < 2 ? 2 : h
+  end
+
+  def PackedCache.header
+    @index.pread(HeaderLen, 0).unpack(HeaderFmt)
+  end
+
+  def PackedCache.writeHeader(total, count)
+    @index.pwrite([Magic, @nSlots, total, count].pack(HeaderFmt), 0)
+  end
+
+  def PackedCache.readSlot(i)
+    @index.pread(SlotLen, HeaderLen + i*SlotLen).unpack(SlotFmt)
+  end
+
+  def PackedCache.writeSlot(i, slot)
+    @index.pwrite(slot.pack(SlotFmt), HeaderLen + i*SlotLen)
+  end
+
+  def PackedCache.findSlot(key, h)
+    # Linear probing from h, stop at the first free slot
+    # Return [slot number, slot] or nil
+    @nSlots.times { |n|
+      i = (h + n) % @nSlots
+      slot = readSlot(i)
+      return nil if slot[0] == Empty
+      if slot[0] == h then
+        # Check the key itself, 64 bits do collide once in a while
+        return [i, slot] if segFile(slot[1]).pread(key.length, slot[2] + RecLen) == key
+      end
+    }
+    nil
+  end
+
+  def PackedCache.freeSlot(h)
+    @nSlots.times { |n|
+      i = (h + n) % @nSlots
+      return i if readSlot(i)[0] < 2
+    }
+    nil
+  end
+
+  def PackedCache.segName(seg)
+    sprintf("%s/seg.%06d", @dir, seg)
+  end
+
+  def PackedCache.segFile(seg)
+    # Segment opened for reading. Forget the ones that other processes have compacted away
+    # when opening a new one, or they would never be released
+    unless @segs[seg]
+      oldest = segments.first || seg
+      @segs.keys.each { |s| @segs.delete(s).close if s < oldest }
+      @segs[seg] = File.open(segName(seg), "rb")
+    end
+    @segs[seg]
+  end
+
+  def PackedCache.segments
+    # Segment numbers, oldest first. The directory is flat and only holds a few segments
+    Dir.entries(@dir).grep(/^seg\.(\d+)$/) { $1.to_i }.sort
+  end
+
+  def PackedCache.append(key, meta, data)
+    # Append record to the newest segment, start a new one when it is full
+    # Return [segment, offset]
+    seg = segments.last || 1
+    seg += 1 if FileTest.exist?(segName(seg)) and File.size(segName(seg)) >= @segSize
+    File.open(segName(seg), "ab") { |f|
+      # Append mode does not move to the end before the first write
+      f.seek(0, IO::SEEK_END)
+      off = f.pos
+      f.write([RecMagic, key.length, meta.length, data.length].pack(RecFmt), key, meta, data)
+      return [seg, off]
+    }
+  end
+
+  def PackedCache.compact(maxSegs, whenNeeded=true)
+    # Compact up to maxSegs segments, oldest first, stop as soon as the store is small enough
+    # Return number of compacted segments
+    n = 0
+    while n < maxSegs
+      total, count = header[TOTAL], header[COUNT]
+      break if whenNeeded and total <= @maxSize*9/10 and count <= @nSlots*7/10
+      segs = segments
+      break if segs.length == 0
+      # Never compact the segment we append to, start a new one if it's the only one left
+      rollOver if segs.length == 1
+      compactSegment(segs.first)
+      n += 1
+    end
+    n
+  end
+
+  def PackedCache.rollOver
+    # Create an empty segment, next records will be appended to it
+    File.open(segName((segments.last||0) + 1), "wb") {}
+  end
+
+  def PackedCache.compactSegment(seg)
+    t = Time.now.to_i
+    total, count = header[TOTAL], header[COUNT]
+    File.open(segName(seg), "rb") { |f|
+      off = 0
+      size = f.size
+      while off + RecLen <= size
+        magic, klen, mlen, dlen = f.pread(RecLen, off).unpack(RecFmt)
+        break unless magic == RecMagic
+        reclen = RecLen + klen + mlen + dlen
+        key = f.pread(klen, off + RecLen)
+        i, slot = findSlot(key, hashKey(key))
+        total -= reclen
+        if slot and slot[1] == seg and slot[2] == off then
+          # Live entry, keep it if it has been used and is not too old
+          if slot[8] != 0 and (@ttl == 0 or t - slot[7] < @ttl) then
+            rec = f.pread(mlen + dlen, off + RecLen + klen)
+            nseg, noff = append(key, rec[0, mlen], rec[mlen, dlen])
+            total += reclen
+            writeSlot(i, [slot[0], nseg, noff, mlen, dlen, slot[5], slot[6], t, 0])
+          else
+            writeSlot(i, [Deleted, 0, 0, 0, 0, 0, 0, 0, 0])
+            count -= 1
+          end
+        end
+        off += reclen
+      end
+    }
+    writeHeader([total, 0].max, [count, 0].max)
+    @segs.delete(seg).close rescue nil
+    File.unlink(segName(seg))
+    # Too many deleted slots make probing slow, start again from a clean table
+    rehash if count < @nSlots/2 and deletedSlots > @nSlots/4
+  end
+
+  def PackedCache.deletedSlots
+    n = 0
+    @index.pread(@nSlots*SlotLen, HeaderLen).unpack("Qx#{SlotLen-8}"*@nSlots).each { |h| n += 1 if h == Deleted }
+    n
+  end
+
+  def PackedCache.rehash
+    slots = []
+    @nSlots.times { |i| s = readSlot(i); slots << s if s[0] >= 2 }
+    @index.pwrite("\0" * (@nSlots*SlotLen), HeaderLen)
+    slots.each { |s| writeSlot(freeSlot(s[0]), s) }
+  end
+end
+
+end
@@ -24,6 +24,10 @@ require 'cgi'
 
 class GentooServlet < WEBrick::HTTPServlet::FileHandler
   include Gorg
+
+  # Seconds a server must have been up before it restarts over memoryLimit
+  # A fresh server that is already over it would otherwise restart forever
+  RestartUptime = 60
   
   def do_GET(req, res)
     hit = "#{$Config["root"]}#{req.path}"
@@ -78,8 +82,11 @@ class GentooServlet < WEBrick::HTTPServlet::FileHandler
                 # We need CGI:Cookie objects to be compatible with our cgi modules (stupid WEBrick)
                 ck = req.raw_header.find{|l| l =~ /^cookie: /i}
                 if ck then
-                  query_params.merge!(cookies_to_params(CGI::Cookie.parse($'.strip)))
+                  cookieParams = cookies_to_params(CGI::Cookie.parse($'.strip))
+                  query_params.merge!(cookieParams)
                   debug "query params are " + query_params.inspect
+                  # Same as do_CGI, pages that depend on cookies vary on them
+                  vary = "Cookie" if cookieParams.length > 0 and Gorg::Cache.usedParams(cacheName, cookieParams).to_a.length > 0
                 end
               end
               if $Config["httphost"] then
@@ -95,29 +102,71 @@ class GentooServlet < WEBrick::HTTPServlet::FileHandler
                                            end
               end
 
+              xml_query = query_params.dup
+              if $Config["linkParam"] then
+                xml_query[$Config["linkParam"]] = req.path
+              end
+
               bodyZ = nil
-              body, mstat, extrameta = Gorg::Cache.hit(cacheName, query_params, inm, ims)
-              if body.nil? then
-                xml_query = query_params.dup
-                if $Config["linkParam"] then
-                  xml_query[$Config["linkParam"]] = req.path
-                end
+              head = nil
+              if req.request_method == "HEAD" or inm or ims then
+                # Headers and 304's only need the dependencies recorded in the cache, do not read or render the page
+                mstat, extrameta = Gorg::Cache.manifest(cacheName, query_params, inm, ims)
+                head = mstat if req.request_method == "HEAD" and mstat and mstat.size
+              end
+              body, mstat, extrameta, stale = Gorg::Cache.hit(cacheName, query_params, inm, ims) unless head
+              # Let load tests (gorg-bench) measure the hit ratio
+              res['X-Gorg-Cache'] = (head or body) ? (stale ? "stale" : "hit") : "miss"
+              if head then
+                # Nothing to do, lengths come from the manifest
+              elsif body.nil? then
                 # Cache miss, process file and cache result
-                err, body, filelist, extrameta = xproc(hit, xml_query, true)
-                warn("#{err.collect{|e|e.join(':')}.join('; ')}") if err["xmlErrLevel"] == 1
-                error("#{err.collect{|e|e.join(':')}.join('; ')}") if err["xmlErrLevel"] > 1
-                # Display error message if any, just like the cgi/fcgi versions
-                raise ("#{err.collect{|e|e.join(':')}.join('<br/>')}") if err["xmlErrLevel"] > 0
-                # Cache output
-                mstat, bodyZ = Gorg::Cache.store(body, cacheName, query_params, filelist, extrameta)
+                t0 = Time.now
+                err, body, filelist, extrameta, declared, trace = xproc(hit, xml_query, true)
+                logSlow(cacheName, Time.now-t0, trace)
+                if xslStopped?(err) then
+                  # Do not keep the visitor waiting, serve whatever we rendered before, however old
+                  warn("#{cacheName}: #{err["xmlErrMsg"]}")
+                  body, mstat, extrameta = Gorg::Cache.hit(cacheName, query_params, nil, nil, true)
+                  raise Gorg::Status::ServiceUnavailable if body.nil?
+                  res['Warning'] = '110 - "Response is Stale"'
+                  res['X-Gorg-Cache'] = "stale"
+                  if $Config["zipLevel"] > 0 then
+                    bodyZ = body
+                    body = nil
+                  end
+                else
+                  warn("#{err.collect{|e|e.join(':')}.join('; ')}") if err["xmlErrLevel"] == 1
+                  error("#{err.collect{|e|e.join(':')}.join('; ')}") if err["xmlErrLevel"] > 1
+                  # Display error message if any, just like the cgi/fcgi versions
+                  raise ("#{err.collect{|e|e.join(':')}.join('<br/>')}") if err["xmlErrLevel"] > 0
+                  # Cache output
+                  mstat, bodyZ = Gorg::Cache.store(body, cacheName, query_params, filelist, extrameta, declared)
+                end
               else
                 if $Config["zipLevel"] > 0 then
                   bodyZ = body
                   body = nil
                 end
+                if stale then
+                  # Serve it now and render it again for the next visitors
+                  res['Warning'] = '110 - "Response is Stale"'
+                  revalidate(cacheName, hit, xml_query, query_params)
+                end
               end
               # If client accepts gzip encoding and we support it, return gzipped file
-              if bodyZ and $Config["zipLevel"] > 0 and (req.accept_encoding.include?("gzip") or req.accept_encoding.include?("x-gzip")) then
+              gz = $Config["zipLevel"] > 0 && (req.accept_encoding.include?("gzip") or req.accept_encoding.include?("x-gzip"))
+              if head then
+                # WEBrick leaves the body out of HEAD responses but keeps our Content-Length
+                res.body = ""
+                if gz and head.sizeZ then
+                  res['Content-Length'] = head.sizeZ.to_s
+                  res['Content-Encoding'] = "gzip"
+                  res['Vary'] = "Accept-Encoding"
+                else
+                  res['Content-Length'] = head.size.to_s
+                end
+              elsif bodyZ and gz then
                 res.body = bodyZ
                 res['Content-Encoding'] = "gzip"
                 res['Vary'] = "Accept-Encoding"
@@ -129,13 +178,15 @@ class GentooServlet < WEBrick::HTTPServlet::FileHandler
                   res.body = gunzip(bodyZ)
                 end
               end
+              res['Vary'] = [res['Vary'], vary].compact.join(", ") if vary
               # Add cookies to http header
               cookies = makeCookies(extrameta)
               if cookies then
                 cookies.each{|c| res.cookies << c.to_s}
               end
-              # Add Content-Type to header
-              ct = contentType(extrameta).split(';')[0]
+              # Add Content-Type to header, fresh output has none in extrameta yet
+              ct = contentType(extrameta) || (setContentType(body) if body)
+              ct = ct.split(';')[0] if ct
               if ct then
                 # Turn application/xhtml+xml into text/html if browser does not accept it
                 if req.accept.to_s !~ /application\/xhtml\+xml/ and ct =~ /application\/xhtml\+xml(.*)$/ then
@@ -156,7 +207,10 @@ class GentooServlet < WEBrick::HTTPServlet::FileHandler
               # One of ours (Gorg::Status::HTTPStatus)
               res.body = ex.html
               res.status = ex.errCode
+              ex.vary = vary if vary and ex.respond_to?(:vary=)
               ex.header.each {|k,v| res[k]=v unless k =~ /status|cookie/i}
+              # 304's send the cookies of the page again
+              ex.cookies.each{|c| res.cookies << c.to_s} if ex.respond_to?(:cookies) and ex.cookies
             else
               # Some ruby exceptions occurred, make it a syserr
               syserr = Gorg::Status::SysError.new
@@ -164,6 +218,19 @@ class GentooServlet < WEBrick::HTTPServlet::FileHandler
               res.status = syserr.errCode
             end
           end
+          # Restart once the requests in progress are answered if we have grown too fat
+          $gorgServed += 1
+          if not $gorgRestart and mem = memoryExceeded then
+            uptime = (Time.now - $gorgStarted).to_i
+            if uptime < RestartUptime then
+              warn("Not restarting after #{$gorgServed} requests in #{uptime}s, is memoryLimit too low? #{mem}") unless $gorgTooFat
+              $gorgTooFat = true
+            else
+              info("Restarting after #{$gorgServed} requests in #{uptime}s : #{mem}")
+              $gorgRestart = true
+              @server.shutdown
+            end
+          end
         end
       end
     end
@@ -203,5 +270,10 @@ def www
 
   puts "\n\nStarting the Gorg web server on #{$Config['listen']}:#{$Config['port']}\n\nHit Ctrl-C or type \"kill #{$$}\" to stop it\n\n"
 
+  $gorgStarted = Time.now
+  $gorgServed = 0
   s.start
+
+  # Start afresh, see memoryLimit
+  exec(RbConfig.ruby, $0, *ARGV) if $gorgRestart
 end
@@ -0,0 +1,57 @@
+require 'spec_helper'
+
+describe "Gorg::XSL arena" do
+  before(:all) do
+    # Every item builds and drops a few strings, i.e. blocks the arena can hand out again
+    items = (1..2000).collect{ |i| "<i n=\"#{i}\">item #{i} #{'x'*50}</i>" }.join
+    @dir = makeSite("big.xml" => "<r>#{items}</r>",
+                    "big.xsl" => xslWith(%q{<out><xsl:for-each select="r/i"><v><xsl:value-of select="string-length(translate(concat(., ., @n), 'x', 'y'))"/></v></xsl:for-each></out>}))
+    @xsl = Gorg::XSL.new
+    @xsl.xml = "#{@dir}/htdocs/big.xml"
+    @xsl.xsl = "#{@dir}/htdocs/big.xsl"
+    Gorg::XSL.arena = false
+    @xsl.process
+    @expected = @xsl.xres
+  end
+
+  after(:each) do
+    # Back to what gorgInit set
+    Gorg::XSL.arena = $Config["xmlArena"]
+    Gorg::XSL.arena_max = $Config["xmlArenaMax"]*1024*1024
+  end
+
+  after(:all) do
+    removeSite(@dir)
+  end
+
+  it "is off by default and leaves no statistics" do
+    @xsl.process
+    assert_nil @xsl.xmem
+  end
+
+  it "gives the same result and reuses freed blocks" do
+    Gorg::XSL.arena = true
+    Gorg::XSL.arena_max = 0
+    @xsl.process
+    assert_equal @expected, @xsl.xres
+    mem = @xsl.xmem
+    assert mem["chunks"] > 0
+    assert mem["reuses"] > 0
+    assert_equal 0, mem["overflows"]
+    assert mem["chunkBytes"] < mem["bytes"], "chunks should be smaller than what was requested in all"
+    %w(rssBefore rssArena rssAfter).each { |k| assert mem.has_key?(k), k }
+  end
+
+  it "falls back on the heap past its ceiling" do
+    Gorg::XSL.arena = true
+    Gorg::XSL.arena_max = 512*1024
+    @xsl.process
+    assert_equal @expected, @xsl.xres
+    assert @xsl.xmem["chunkBytes"] <= 512*1024
+    assert @xsl.xmem["overflows"] > 0
+  end
+
+  it "takes its ceiling from xmlArenaMax" do
+    assert_equal 64*1024*1024, Gorg::XSL.arena_max
+  end
+end
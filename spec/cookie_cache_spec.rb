@@ -0,0 +1,58 @@
+require 'spec_helper'
+
+describe "Gorg pages that depend on cookies" do
+  before(:each) do
+    # page.xsl declares theme and remembers it in the prefs cookie, plain.xsl declares nothing
+    @dir = makeSite({"page.xml"  => xmlWith("<doc/>", "/page.xsl"),
+                     "page.xsl"  => xslWith(%q{<xsl:message>%%GORG%%Set-Cookie(prefs)theme=<xsl:value-of select="$theme"/></xsl:message><html><body><xsl:value-of select="$theme"/></body></html>}, "theme" => "default"),
+                     "plain.xml" => xmlWith("<doc/>", "/plain.xsl"),
+                     "plain.xsl" => xslWith(%q{<html><body>plain</body></html>})},
+                    "acceptCookies" => 1, "zipLevel" => 0)
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def header(out, name)
+    out[/^#{name}: (.*?)\r$/, 1]
+  end
+
+  def get(path, env={})
+    cgiRequest(@dir, "GET", path, env)
+  end
+
+  it "varies on Cookie once a declared param comes from a cookie" do
+    out = get("/page.xml", "HTTP_COOKIE" => "prefs=theme%3Da")
+    assert_match(/<body>a<\/body>/, out)
+    assert_equal "Cookie", header(out, "Vary")
+    assert_match(/^Set-Cookie: prefs=theme%3Da/, out)
+    # Cached apart from other themes
+    out = get("/page.xml", "HTTP_COOKIE" => "prefs=theme%3Db")
+    assert_match(/<body>b<\/body>/, out)
+    out = get("/page.xml", "HTTP_COOKIE" => "prefs=theme%3Da")
+    assert_equal "hit", header(out, "X-Gorg-Cache")
+    assert_match(/<body>a<\/body>/, out)
+    assert_equal "Cookie", header(out, "Vary")
+  end
+
+  it "does not vary on cookies the stylesheets do not declare" do
+    get("/plain.xml")
+    out = get("/plain.xml", "HTTP_COOKIE" => "prefs=theme%3Da")
+    assert_equal "hit", header(out, "X-Gorg-Cache")
+    assert_nil header(out, "Vary")
+    out = get("/page.xml")
+    assert_nil header(out, "Vary")
+  end
+
+  it "sends the cookies and Vary again with a 304" do
+    etag = header(get("/page.xml", "HTTP_COOKIE" => "prefs=theme%3Da"), "ETag")
+    out = get("/page.xml", "HTTP_COOKIE" => "prefs=theme%3Da", "HTTP_IF_NONE_MATCH" => etag)
+    assert_match(/^Status: 304 Not Modified\r$/, out)
+    assert_match(/^Set-Cookie: prefs=theme%3Da/, out)
+    assert_equal "Cookie", header(out, "Vary")
+    out = cgiRequest(@dir, "HEAD", "/page.xml", "HTTP_COOKIE" => "prefs=theme%3Da")
+    assert_equal "hit", header(out, "X-Gorg-Cache")
+    assert_equal "Cookie", header(out, "Vary")
+  end
+end
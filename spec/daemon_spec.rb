@@ -0,0 +1,121 @@
+require 'spec_helper'
+require 'gorg/daemon'
+require 'gorg/client'
+require 'socket'
+require 'tempfile'
+
+describe "Gorg daemon and client" do
+  Client = Gorg::Client
+
+  before(:each) do
+    @dir = makeSite("page.xsl" => xslWith(%q{<out><xsl:value-of select="concat($lang, ':', doc)"/></out>}, "lang" => "en"))
+    @path = "#{@dir}/gorg.sock"
+    @server = UNIXServer.new(@path)
+    Gorg::Daemon.instance_variable_set(:@root, $Config["root"])
+  end
+
+  after(:each) do
+    @thread.join if @thread
+    @server.close
+    removeSite(@dir)
+  end
+
+  # Answer the next request with the block, Daemon.serve by default
+  def answer(&block)
+    block ||= lambda { |sock| Gorg::Daemon.serve(sock) }
+    @thread = Thread.new { block.call(@server.accept) }
+  end
+
+  # Run the block with STDOUT & STDERR going to files, return what it returned and what it wrote
+  def captured
+    out, err = [Tempfile.new("out"), Tempfile.new("err")]
+    saved = [STDOUT.dup, STDERR.dup]
+    STDOUT.reopen(out); STDERR.reopen(err)
+    result = begin
+      yield
+    ensure
+      STDOUT.reopen(saved[0]); STDERR.reopen(saved[1])
+    end
+    [result, File.read(out.path), File.read(err.path)]
+  ensure
+    [out, err].each { |f| f.close! if f }
+  end
+
+  def filter(xml, params={})
+    captured { Client.request(@path, "filter", {}, params) { xml } }
+  end
+
+  it "reads back the strings and hashes it writes" do
+    io = StringIO.new
+    Client.putString(io, "héllo")
+    Client.putString(io, "")
+    Client.putHash(io, {"a" => "1", "b" => ""})
+    io.rewind
+    # Strings come back in the default external encoding, compare bytes
+    assert_equal "héllo".b, Client.getString(io).b
+    assert_equal "", Client.getString(io)
+    assert_equal({"a" => "1", "b" => ""}, Client.getHash(io))
+  end
+
+  it "refuses requests cut short" do
+    io = StringIO.new
+    Client.putString(io, "hello")
+    assert_raises(RuntimeError) { Client.getString(StringIO.new(io.string[0..-2])) }
+    assert_raises(RuntimeError) { Client.getString(StringIO.new("\0\0")) }
+    assert_raises(RuntimeError) { Client.getHash(StringIO.new([2].pack("N") + io.string)) }
+    assert_raises(RuntimeError) { Client.readRequest(StringIO.new("GORG0")) }
+  end
+
+  it "transforms what the client sends and returns its status" do
+    answer
+    status, out, = filter(xmlWith("<doc>hello</doc>", "#{@dir}/htdocs/page.xsl"), "lang" => "fr")
+    assert_equal 0, status
+    assert_match(/<out>fr:hello<\/out>/, out)
+  end
+
+  it "returns status 1 and the error when the transform fails" do
+    answer
+    status, out, err = filter("<doc>unclosed")
+    assert_equal 1, status
+    assert_equal "", out
+    refute_equal "", err
+  end
+
+  it "serves cgi requests" do
+    File.write("#{@dir}/htdocs/page.xml", xmlWith("<doc>hello</doc>", "/page.xsl"))
+    answer
+    env = { "REQUEST_METHOD" => "GET", "DOCUMENT_ROOT" => "#{@dir}/htdocs", "PATH_INFO" => "/page.xml",
+            "PATH_TRANSLATED" => "#{@dir}/htdocs/page.xml", "REQUEST_URI" => "/page.xml", "SCRIPT_NAME" => "/page.xml",
+            "QUERY_STRING" => "", "SERVER_NAME" => "localhost", "SERVER_PORT" => "80" }
+    status, out, = captured { Client.request(@path, "cgi", env, {}) { "" } }
+    assert_equal 0, status
+    assert_match(/\AContent-Type: /, out)
+    assert_match(/<out>en:hello<\/out>/, out)
+  end
+
+  it "raises when the response has no end frame" do
+    answer { |sock|
+      Client.readRequest(sock)
+      Client::FrameWriter.new(sock, "o").write("partial")
+      sock.close
+    }
+    assert_raises(RuntimeError) { filter("<doc/>") }
+  end
+
+  it "raises when the response stops in the middle of a frame" do
+    answer { |sock|
+      Client.readRequest(sock)
+      sock.write(["o", 100].pack("aN"), "short")
+      sock.close
+    }
+    e = assert_raises(RuntimeError) { filter("<doc/>") }
+    assert_match(/Truncated response/, e.message)
+  end
+
+  it "cannot reach a daemon that is not there" do
+    called = false
+    assert_equal false, Client.request(nil, "filter", {}, {}) { called = true }
+    assert_equal false, Client.request("#{@dir}/nothing.sock", "filter", {}, {}) { called = true }
+    refute called, "input must not be read when there is no daemon"
+  end
+end
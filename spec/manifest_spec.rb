@@ -0,0 +1,74 @@
+require 'spec_helper'
+
+describe "Gorg::Cache.manifest" do
+  before(:each) do
+    @dir = makeSite({"page.xml" => xmlWith("<doc>#{"hello " * 100}</doc>", "/page.xsl"),
+                     "page.xsl" => xslWith(%q{<html><body><xsl:value-of select="doc"/></body></html>})},
+                    "zipLevel" => 6)
+    @deps = [["r", "#{@dir}/htdocs/page.xml"], ["r", "#{@dir}/htdocs/page.xsl"]]
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def header(out, name)
+    out[/^#{name}: (.*?)\r$/, 1]
+  end
+
+  it "tells the sizes and ETag of a stored page without reading it" do
+    body = "<html>#{'hello ' * 100}</html>"
+    stored, = Cache.store(body, "/page.xml", {}, @deps, ["Set-Cookie:prefs=a"])
+    mstat, extrameta = Cache.manifest("/page.xml", {})
+    assert_kind_of Cache::Manifest, mstat
+    assert_equal stored.etag, mstat.etag
+    assert_equal body.length, mstat.size
+    assert mstat.sizeZ < mstat.size
+    assert_includes extrameta, "Set-Cookie:prefs=a"
+    assert_nil Cache.manifest("/other.xml", {})
+  end
+
+  it "raises NotModified when the client has the page already" do
+    stored, = Cache.store("<html/>", "/page.xml", {}, @deps)
+    ex = assert_raises(Gorg::Status::NotModified) { Cache.manifest("/page.xml", {}, [stored.etag]) }
+    assert_equal stored.etag, ex.header['ETag']
+    assert_raises(Gorg::Status::NotModified) { Cache.manifest("/page.xml", {}, nil, stored.mtime + 1) }
+    refute_nil Cache.manifest("/page.xml", {}, ['"other"'])
+  end
+
+  it "knows nothing once a dependency has changed" do
+    Cache.store("<html/>", "/page.xml", {}, @deps)
+    File.write("#{@dir}/htdocs/page.xsl", xslWith("<html>changed</html>"))
+    assert_nil Cache.manifest("/page.xml", {})
+  end
+
+  it "leaves the extra meta data of the caller alone" do
+    extrameta = ["Set-Cookie:prefs=a"]
+    Cache.store("<html/>", "/page.xml", {}, @deps, extrameta)
+    assert_equal ["Set-Cookie:prefs=a"], extrameta
+    _, meta = Cache.manifest("/page.xml", {})
+    assert_includes meta, "Content-Type:text/html"
+  end
+
+  it "answers HEAD requests with the lengths of the cached page" do
+    out = cgiRequest(@dir, "GET", "/page.xml")
+    assert_equal "miss", header(out, "X-Gorg-Cache")
+    length = out.split("\r\n\r\n", 2)[1].length
+    out = cgiRequest(@dir, "HEAD", "/page.xml")
+    assert_equal "hit", header(out, "X-Gorg-Cache")
+    assert_equal length.to_s, header(out, "Content-Length")
+    assert_equal "", out.split("\r\n\r\n", 2)[1]
+    out = cgiRequest(@dir, "HEAD", "/page.xml", "HTTP_ACCEPT_ENCODING" => "gzip")
+    assert_equal "gzip", header(out, "Content-Encoding")
+    assert header(out, "Content-Length").to_i < length
+  end
+
+  it "answers 304 to a client that has the page already" do
+    etag = header(cgiRequest(@dir, "GET", "/page.xml"), "ETag")
+    out = cgiRequest(@dir, "GET", "/page.xml", "HTTP_IF_NONE_MATCH" => etag)
+    assert_match(/^Status: 304 Not Modified\r$/, out)
+    assert_equal etag, header(out, "ETag")
+    out = cgiRequest(@dir, "GET", "/page.xml", "HTTP_IF_NONE_MATCH" => '"other"')
+    assert_match(/<body>hello hello /, out)
+  end
+end
@@ -0,0 +1,47 @@
+require 'spec_helper'
+
+describe "Gorg::XSL.memory_stats" do
+  before(:each) do
+    @dir = makeSite("doc.xml" => "<r>#{'<i>item</i>' * 500}</r>",
+                    "doc.xsl" => xslWith(%q{<o><xsl:for-each select="r/i"><v><xsl:value-of select="concat(., position())"/></v></xsl:for-each></o>}))
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def transform
+    xsl = Gorg::XSL.new
+    xsl.xml = "#{@dir}/htdocs/doc.xml"
+    xsl.xsl = "#{@dir}/htdocs/doc.xsl"
+    xsl.process
+    xsl
+  end
+
+  it "tells what libxml2 holds and the RSS of the process" do
+    mem = Gorg::XSL.memory_stats
+    %w(live peak allocs frees lastDelta lastPeak rss).each { |k| assert_kind_of Integer, mem[k], k }
+    assert mem["rss"] > 0
+  end
+
+  it "tells how much the last transform used" do
+    transform
+    mem = Gorg::XSL.memory_stats
+    assert mem["lastPeak"] > 0
+    assert mem["allocs"] >= mem["frees"]
+    assert mem["peak"] >= mem["live"]
+    # The result document has been freed, not much is left over
+    assert mem["lastDelta"] < mem["lastPeak"]
+  end
+
+  it "is not checked against memoryLimit when there is none" do
+    assert_nil memoryExceeded
+  end
+
+  it "says by how much memoryLimit has been exceeded" do
+    $Config["memoryLimit"] = 1
+    assert_match(/\A\d+MB used, limit is 1MB \(libxml2 holds \d+KB, peaked at \d+KB\)\z/, memoryExceeded)
+    $Config["memoryLimit"] = 1024*1024
+    assert_nil memoryExceeded
+  end
+end
@@ -0,0 +1,84 @@
+require 'spec_helper'
+require 'gorg/packed'
+
+describe "Gorg::PackedCache" do
+  Packed = Gorg::PackedCache
+
+  before(:each) do
+    @dir = Dir.mktmpdir("gorg-packed")
+    Packed.init(@dir, 10*1024*1024, 0, 64)
+  end
+
+  after(:each) do
+    FileUtils.rm_rf(@dir)
+  end
+
+  it "gives back what was put" do
+    t = Time.now - 3600
+    stat = Packed.put("key", "meta", "data" * 100, t)
+    assert_equal 400, stat.size
+    e = Packed.get("key")
+    assert_equal "meta", e.meta
+    assert_equal "data" * 100, e.data
+    assert_equal 400, e.stat.size
+    assert_equal t.to_i, e.stat.mtime.to_i
+    assert_nil Packed.get("other")
+  end
+
+  it "replaces and deletes entries" do
+    Packed.put("key", "m1", "old", Time.now)
+    Packed.put("key", "m2", "new", Time.now)
+    assert_equal "new", Packed.get("key").data
+    Packed.delete("key")
+    assert_nil Packed.get("key")
+  end
+
+  it "does not read an entry that has been replaced since it was found" do
+    Packed.put("key", "m", "old", Time.now)
+    e = Packed.get("key")
+    Packed.put("key", "m", "new", Time.now)
+    assert_nil e.data
+  end
+
+  it "keeps only the entries used since their segment was written when compacting it" do
+    Packed.put("used", "m", "u", Time.now)
+    Packed.put("unused", "m", "x", Time.now)
+    Packed.get("used").touch
+    Packed.wash(true)
+    assert_equal "u", Packed.get("used").data
+    assert_nil Packed.get("unused")
+    # The entry has to be used again to survive the next compaction
+    Packed.wash(true)
+    assert_nil Packed.get("used")
+  end
+
+  it "keeps the store under its size by compacting the oldest segments" do
+    FileUtils.rm_rf(@dir)
+    Packed.init(@dir, 1024*1024, 0, 4096)
+    300.times { |i| Packed.put("k#{i}", "m", "d" * 10000, Time.now) }
+    total, count, = Packed.wash
+    assert total <= 1024*1024
+    assert count < 300
+    assert_equal "d" * 10000, Packed.get("k299").data
+  end
+
+  it "opens its own index in a forked process" do
+    Packed.get("nothing")
+    pid = fork {
+      Packed.put("child", "m", "from child", Time.now)
+      exit!(0)
+    }
+    Process.wait(pid)
+    assert_equal "from child", Packed.get("child").data
+
+    # The lock the parent holds keeps the child out
+    Packed.send(:locked, File::LOCK_EX) {
+      pid = fork {
+        Packed.send(:forked?)
+        exit!(Packed.instance_variable_get(:@index).flock(File::LOCK_EX|File::LOCK_NB) ? 1 : 0)
+      }
+      Process.wait(pid)
+    }
+    assert_equal 0, $?.exitstatus
+  end
+end
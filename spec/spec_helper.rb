@@ -1,3 +1,62 @@
 # spec_helper.rb
 
 require 'gorg/base'
+require 'tmpdir'
+require 'fileutils'
+require 'stringio'
+
+# Same as bin/gorg & co., the log functions are used everywhere
+include Gorg
+
+module GorgSpec
+  # A site in a temporary directory: documents under htdocs, cache under cache
+  # Write files (name => content) in htdocs, a gorg.conf with conf on top of our defaults
+  # and run gorgInit on it. Return the directory, removeSite gets rid of it
+  def makeSite(files={}, conf={})
+    dir = Dir.mktmpdir("gorg-spec")
+    FileUtils.mkdir_p(["#{dir}/htdocs", "#{dir}/cache"])
+    files.each { |name, content|
+      FileUtils.mkdir_p(File.dirname("#{dir}/htdocs/#{name}"))
+      File.write("#{dir}/htdocs/#{name}", content)
+    }
+    conf = { "root" => "#{dir}/htdocs", "cacheDir" => "#{dir}/cache", "logLevel" => 0, "cacheWash" => 0 }.merge(conf)
+    File.write("#{dir}/gorg.conf", conf.collect{ |k,v| "#{k} = #{v}\n" }.join)
+    ENV["GORG_CONF"] = "#{dir}/gorg.conf"
+    gorgInit
+    dir
+  end
+
+  def removeSite(dir)
+    FileUtils.rm_rf(dir) if dir
+  end
+
+  # Stylesheet with top-level params (name => default) around a template matching /
+  def xslWith(template, params={})
+    %Q{<?xml version="1.0"?>\n<xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">\n} +
+    params.collect{ |n,v| %Q{<xsl:param name="#{n}" select="'#{v}'"/>\n} }.join +
+    %Q{<xsl:template match="/">#{template}</xsl:template>\n</xsl:stylesheet>\n}
+  end
+
+  # Document processed by the given stylesheets
+  def xmlWith(content, *styles)
+    %Q{<?xml version="1.0"?>\n} + styles.collect{ |s| %Q{<?xml-stylesheet type="text/xsl" href="#{s}"?>\n} }.join + content + "\n"
+  end
+
+  # Run do_CGI in this process for the page at path of the site in dir, return what it writes out
+  def cgiRequest(dir, method, path, env={})
+    require 'gorg/daemon'
+    env = { "REQUEST_METHOD" => method, "DOCUMENT_ROOT" => "#{dir}/htdocs", "PATH_INFO" => path,
+            "PATH_TRANSLATED" => "#{dir}/htdocs#{path}", "REQUEST_URI" => path, "SCRIPT_NAME" => path,
+            "QUERY_STRING" => "", "SERVER_NAME" => "localhost", "SERVER_PORT" => "80",
+            "GATEWAY_INTERFACE" => "CGI/1.1" }.merge(env)
+    out = StringIO.new
+    do_CGI(Gorg::DaemonCGI.new(env, StringIO.new(""), out), "/gorg.cgi")
+    out.string
+  end
+end
+
+RSpec.configure do |config|
+  # assert, assert_equal & co. are all we need
+  config.expect_with :minitest
+  config.include GorgSpec
+end
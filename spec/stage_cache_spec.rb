@@ -0,0 +1,57 @@
+require 'spec_helper'
+
+describe "Gorg stage cache" do
+  before(:each) do
+    # s1 does not read any param, s2 reads lang
+    @dir = makeSite({ "doc.xml" => xmlWith("<doc>hello</doc>", "/s1.xsl", "/s2.xsl"),
+                      "s1.xsl"  => xslWith(%q{<stage1><xsl:value-of select="doc"/></stage1>}),
+                      "s2.xsl"  => xslWith(%q{<out><xsl:value-of select="concat($lang, ':', stage1)"/></out>}, "lang" => "en") },
+                    "stageCache" => 1, "slowTime" => 3600)
+    @doc = "#{@dir}/htdocs/doc.xml"
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def filesRead(trace)
+    trace.collect{ |t| t["path"] }
+  end
+
+  it "resumes after the cached stage for another value of a param of the last stylesheet" do
+    err, body, _, _, declared, trace = xproc(@doc, {"lang" => "en"}, true)
+    assert_equal 0, err["xmlErrLevel"]
+    assert_match(/<out>en:hello<\/out>/, body)
+    assert_includes filesRead(trace), "#{@dir}/htdocs/s1.xsl"
+    assert_equal ["lang"], declared
+
+    err, body, files, _, declared, trace = xproc(@doc, {"lang" => "fr"}, true)
+    assert_equal 0, err["xmlErrLevel"]
+    assert_match(/<out>fr:hello<\/out>/, body)
+    refute_includes filesRead(trace), "#{@dir}/htdocs/s1.xsl"
+    # Dependencies of the skipped stage are carried over
+    assert_includes files.collect{ |f| f[1] }, "#{@dir}/htdocs/s1.xsl"
+    assert_equal ["lang"], declared
+  end
+
+  it "runs all stages again once the first stylesheet has changed" do
+    xproc(@doc, {"lang" => "en"}, true)
+    File.write("#{@dir}/htdocs/s1.xsl", xslWith(%q{<stage1>changed</stage1>}))
+    err, body, _, _, _, trace = xproc(@doc, {"lang" => "en"}, true)
+    assert_equal 0, err["xmlErrLevel"]
+    assert_match(/<out>en:changed<\/out>/, body)
+    assert_includes filesRead(trace), "#{@dir}/htdocs/s1.xsl"
+  end
+
+  it "is not used when stageCache is off" do
+    removeSite(@dir)
+    @dir = makeSite({ "doc.xml" => xmlWith("<doc>hello</doc>", "/s1.xsl", "/s2.xsl"),
+                      "s1.xsl"  => xslWith(%q{<stage1><xsl:value-of select="doc"/></stage1>}),
+                      "s2.xsl"  => xslWith(%q{<out><xsl:value-of select="concat($lang, ':', stage1)"/></out>}, "lang" => "en") },
+                    "stageCache" => 0, "slowTime" => 3600)
+    xproc("#{@dir}/htdocs/doc.xml", {"lang" => "en"}, true)
+    _, _, _, _, _, trace = xproc("#{@dir}/htdocs/doc.xml", {"lang" => "fr"}, true)
+    assert_includes filesRead(trace), "#{@dir}/htdocs/s1.xsl"
+    refute File.directory?("#{@dir}/cache/.stages")
+  end
+end
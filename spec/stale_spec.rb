@@ -0,0 +1,78 @@
+require 'spec_helper'
+
+describe "Gorg::Cache stale entries" do
+  ["files", "packed"].each { |store|
+    context "in the #{store} store" do
+      before(:each) do
+        @dir = makeSite({"dep.xml" => "<a/>"}, "zipLevel" => 0, "cacheStale" => 1, "cacheStore" => store)
+        @dep = "#{@dir}/htdocs/dep.xml"
+        Cache.store("<html>1</html>", "/x.xml", {}, [["r", @dep]], [], [])
+      end
+
+      after(:each) do
+        removeSite(@dir)
+      end
+
+      def changeDep(content, mtime=nil)
+        File.write(@dep, content)
+        File.utime(mtime, mtime, @dep) if mtime
+      end
+
+      it "serves fresh entries as such" do
+        body, _, _, stale = Cache.hit("/x.xml", {})
+        assert_equal "<html>1</html>", body
+        assert_equal false, stale
+      end
+
+      it "serves an entry whose dependency has changed as stale for cacheStale seconds" do
+        changeDep("<a>changed</a>")
+        body, _, _, stale = Cache.hit("/x.xml", {})
+        assert_equal "<html>1</html>", body
+        assert_equal true, stale
+        sleep 1.2
+        assert_nil Cache.hit("/x.xml", {})
+      end
+
+      it "counts from when the change was seen, not from the mtime of the dependency" do
+        changeDep("<a>changed</a>", Time.now - 3600)
+        _, _, _, stale = Cache.hit("/x.xml", {})
+        assert_equal true, stale
+      end
+
+      it "serves it however old with anyAge" do
+        changeDep("<a>changed</a>")
+        Cache.hit("/x.xml", {})
+        sleep 1.2
+        body, _, _, stale = Cache.hit("/x.xml", {}, nil, nil, true)
+        assert_equal "<html>1</html>", body
+        assert_equal true, stale
+      end
+
+      it "starts counting again once the entry has been stored again" do
+        changeDep("<a>changed</a>")
+        Cache.hit("/x.xml", {})
+        sleep 1.2
+        Cache.store("<html>2</html>", "/x.xml", {}, [["r", @dep]], [], [])
+        changeDep("<a>changed again</a>")
+        body, _, _, stale = Cache.hit("/x.xml", {})
+        assert_equal "<html>2</html>", body
+        assert_equal true, stale
+      end
+
+      it "does not answer 304 for a stale entry" do
+        mstat, = Cache.store("<html>1</html>", "/x.xml", {}, [["r", @dep]], [], [])
+        changeDep("<a>changed</a>")
+        body, = Cache.hit("/x.xml", {}, mstat.etag)
+        assert_equal "<html>1</html>", body
+      end
+    end
+  }
+
+  it "is never served when cacheStale is 0" do
+    dir = makeSite({"dep.xml" => "<a/>"}, "zipLevel" => 0)
+    Cache.store("<html>1</html>", "/x.xml", {}, [["r", "#{dir}/htdocs/dep.xml"]], [], [])
+    File.write("#{dir}/htdocs/dep.xml", "<a>changed</a>")
+    assert_nil Cache.hit("/x.xml", {})
+    removeSite(dir)
+  end
+end
@@ -0,0 +1,42 @@
+require 'spec_helper'
+
+describe "Gorg::Cache.usedParams" do
+  before(:each) do
+    @dir = makeSite({"page.xml" => xmlWith("<doc/>", "/page.xsl")}, "zipLevel" => 0)
+    @deps = [["r", "#{@dir}/htdocs/page.xml"]]
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  it "keeps all params as long as the page has not been stored" do
+    assert_equal({"lang" => "en", "utm" => "x"}, Cache.usedParams("/page.xml", {"lang" => "en", "utm" => "x"}))
+  end
+
+  it "keeps only the params the stylesheets declare once the page has been stored" do
+    Cache.store("<html>en</html>", "/page.xml", {"lang" => "en", "utm" => "x"}, @deps, [], ["lang"])
+    assert_equal({"lang" => "en"}, Cache.usedParams("/page.xml", {"lang" => "en", "utm" => "y", "other" => "z"}))
+    assert_equal({}, Cache.usedParams("/page.xml", {"utm" => "y"}))
+  end
+
+  it "compares names as strings whatever the keys are" do
+    Cache.store("<html>en</html>", "/page.xml", {"lang" => "en"}, @deps, [], ["lang"])
+    assert_equal({:lang => "en"}, Cache.usedParams("/page.xml", {:lang => "en", :utm => "y"}))
+  end
+
+  it "hits the same entry whatever undeclared params come with the request" do
+    Cache.store("<html>en</html>", "/page.xml", {"lang" => "en", "utm" => "x"}, @deps, [], ["lang"])
+    body, = Cache.hit("/page.xml", {"lang" => "en", "utm" => "other", "fbclid" => "1"})
+    assert_equal "<html>en</html>", body
+    body, = Cache.hit("/page.xml", {"lang" => "en"})
+    assert_equal "<html>en</html>", body
+    assert_nil Cache.hit("/page.xml", {"lang" => "fr", "utm" => "x"})
+  end
+
+  it "leaves undeclared params out of the ETag" do
+    m1, = Cache.store("<html>en</html>", "/page.xml", {"lang" => "en", "utm" => "x"}, @deps, [], ["lang"])
+    m2, = Cache.store("<html>en</html>", "/page.xml", {"lang" => "en", "utm" => "y"}, @deps, [], ["lang"])
+    assert_equal m1.etag, m2.etag
+  end
+end
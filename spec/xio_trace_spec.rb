@@ -0,0 +1,72 @@
+require 'spec_helper'
+
+describe "Gorg::XSL I/O trace" do
+  before(:each) do
+    @dir = makeSite("doc.xml" => "<r/>",
+                    "d1.xml"  => "<a>#{'x' * 1000}</a>",
+                    "doc.xsl" => xslWith(%q{<o><xsl:value-of select="string-length(document('d1.xml')/a)"/><xsl:value-of select="count(document('d1.xml')/a)"/><xsl:value-of select="count(document('none.xml')/a)"/></o>}))
+    @htdocs = "#{@dir}/htdocs"
+    @xsl = Gorg::XSL.new
+    @xsl.xml = "#{@htdocs}/doc.xml"
+    @xsl.xsl = "#{@htdocs}/doc.xsl"
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def traced(path)
+    @xsl.xio.detect{ |t| t["path"] == path }
+  end
+
+  it "tells how many times each file was opened, how much was read and how long it took" do
+    @xsl.xtrace = true
+    @xsl.process
+    assert_match(/<o>100010<\/o>/, @xsl.xres)
+    ["doc.xml", "doc.xsl", "d1.xml"].each { |f|
+      t = traced("#{@htdocs}/#{f}")
+      refute_nil t, f
+      assert_equal 1, t["opens"], f
+      assert_equal File.size("#{@htdocs}/#{f}"), t["bytes"], f
+      assert_kind_of Float, t["time"]
+      assert_equal false, t["missing"]
+    }
+  end
+
+  it "flags files that are not there" do
+    @xsl.xtrace = true
+    @xsl.process
+    t = traced("#{@htdocs}/none.xml")
+    refute_nil t
+    assert_equal true, t["missing"]
+  end
+
+  it "is off by default" do
+    refute @xsl.xtrace?
+    @xsl.process
+    assert_nil @xsl.xio
+  end
+
+  it "adds up the traces of all the stylesheets of a page" do
+    trace = addTrace({}, [{"path" => "/a", "opens" => 1, "bytes" => 10, "time" => 0.5, "missing" => false}])
+    addTrace(trace, [{"path" => "/a", "opens" => 2, "bytes" => 5, "time" => 0.25, "missing" => true},
+                     {"path" => "/b", "opens" => 1, "bytes" => 1, "time" => 0.0, "missing" => false}])
+    addTrace(trace, nil)
+    assert_equal({"path" => "/a", "opens" => 3, "bytes" => 15, "time" => 0.75, "missing" => true}, trace["/a"])
+    assert_equal 1, trace["/b"]["opens"]
+  end
+
+  it "is what slowTime reports on" do
+    removeSite(@dir)
+    @dir = makeSite({"page.xml" => xmlWith("<r/>", "/page.xsl"),
+                     "page.xsl" => xslWith("<o/>")},
+                    "slowTime" => 0.5)
+    $Config["slowLog"] = "#{@dir}/slow.log"
+    err, _, _, _, _, trace = xproc("#{@dir}/htdocs/page.xml", {}, true)
+    assert_equal 0, err["xmlErrLevel"]
+    logSlow("/page.xml", 0.1, trace)
+    refute File.exist?($Config["slowLog"])
+    logSlow("/page.xml", 1, trace)
+    assert_match(/SLOW  \/page.xml 1.000s, \d+ files .*#{@dir}\/htdocs\/page.xsl 0KB/, File.read($Config["slowLog"]))
+  end
+end
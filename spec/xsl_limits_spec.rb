@@ -0,0 +1,89 @@
+require 'spec_helper'
+
+describe "Gorg::XSL limits" do
+  before(:each) do
+    @dir = makeSite("doc.xml" => "<r><i>1</i><i>2</i></r>",
+                    "d1.xml"  => "<a>1</a>",
+                    "d2.xml"  => "<a>2</a>",
+                    "x.dtd"   => "<a>3</a>",
+                    "deep.xsl" => %q{<xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+<xsl:template match="/"><xsl:apply-templates select="r"/></xsl:template>
+<xsl:template match="r"><o><xsl:apply-templates select="i"/></o></xsl:template>
+<xsl:template match="i"><xsl:value-of select="."/></xsl:template>
+</xsl:stylesheet>})
+    @htdocs = "#{@dir}/htdocs"
+    @xsl = Gorg::XSL.new
+    @xsl.xml = "#{@htdocs}/doc.xml"
+  end
+
+  after(:each) do
+    removeSite(@dir)
+  end
+
+  def docs(*uris)
+    File.write("#{@htdocs}/docs.xsl",
+               xslWith("<o>" + uris.collect{ |u| %Q{<xsl:value-of select="document('#{u}')/a"/>} }.join + "</o>"))
+    @xsl.xsl = "#{@htdocs}/docs.xsl"
+  end
+
+  def run
+    @xsl.process rescue nil
+    @xsl.xerr && @xsl.xerr["xmlErrCode"]
+  end
+
+  def run_with_deadline(deadline)
+    @xsl.process(deadline: deadline) rescue nil
+    @xsl.xerr && @xsl.xerr["xmlErrCode"]
+  end
+
+  it "stops a transform once its deadline has passed" do
+    @xsl.xsl = "#{@htdocs}/deep.xsl"
+    assert_equal Gorg::XSL::ERR_DEADLINE, run_with_deadline(0)
+    assert_nil @xsl.xres
+    assert_equal Gorg::XSL::ERR_DEADLINE, run_with_deadline(Time.now - 1)
+    assert_equal 0, run_with_deadline(60)
+    assert_match(/<o>12<\/o>/, @xsl.xres)
+  end
+
+  it "stops a transform that nests more templates than xmaxdepth" do
+    @xsl.xsl = "#{@htdocs}/deep.xsl"
+    @xsl.xmaxdepth = 2
+    assert_equal Gorg::XSL::ERR_MAXDEPTH, run
+    assert_match(/more than 2 nested templates/, @xsl.xerr["xmlErrMsg"])
+    @xsl.xmaxdepth = 3
+    assert_equal 0, run
+    assert_match(/<o>12<\/o>/, @xsl.xres)
+  end
+
+  it "stops a transform that opens more documents than xmaxdocs" do
+    docs("d1.xml", "d2.xml")
+    @xsl.xmaxdocs = 1
+    assert_equal Gorg::XSL::ERR_MAXDOCS, run
+    assert_match(/more than 1 documents/, @xsl.xerr["xmlErrMsg"])
+    @xsl.xmaxdocs = 2
+    assert_equal 0, run
+    assert_match(/<o>12<\/o>/, @xsl.xres)
+  end
+
+  it "counts documents whatever their URI or extension" do
+    docs("file://#{@htdocs}/d1.xml", "x.dtd", "d2.xml")
+    @xsl.xmaxdocs = 2
+    assert_equal Gorg::XSL::ERR_MAXDOCS, run
+    @xsl.xmaxdocs = 3
+    assert_equal 0, run
+    assert_match(/<o>132<\/o>/, @xsl.xres)
+  end
+
+  it "applies the limits of gorg.conf in xproc and tells them apart from other errors" do
+    removeSite(@dir)
+    @dir = makeSite({"doc.xml" => xmlWith("<r/>", "/docs.xsl"),
+                     "d1.xml"  => "<a>1</a>",
+                     "d2.xml"  => "<a>2</a>",
+                     "docs.xsl" => xslWith(%q{<o><xsl:value-of select="document('d1.xml')/a"/><xsl:value-of select="document('d2.xml')/a"/></o>})},
+                    "xslMaxDocuments" => 1)
+    err, body, = xproc("#{@dir}/htdocs/doc.xml", {})
+    assert xslStopped?(err), err.inspect
+    refute_match(/<o>/, body.to_s)
+    refute xslStopped?({"xmlErrCode" => 1, "xmlErrLevel" => 3})
+  end
+end